@@ -0,0 +1,202 @@
+#pragma once
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Process-wide I/O settings, filled in from the command line.
+struct io_config {
+    bool async = false;    // double-buffer fast_reader/fast_writer on a background thread
+    size_t ibuf = 1 << 20; // fast_reader buffer, set by the memory planner
+    size_t obuf = 1 << 20; // fast_writer buffer, set by the memory planner
+    bool compress = false; // temp runs in the packed format of run_codec.hh
+
+    // Extension of temp run files; fast_reader/fast_writer pack "*.run" files.
+    const char* run_suffix() const {
+        return compress ? ".run" : ".txt";
+    }
+};
+
+inline io_config io;
+
+// writev() that retries until every buffer is out; `iov` is consumed.
+inline void write_all(int fd, iovec* iov, int n) {
+    while (n) {
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            exit(1);
+        }
+        for (; n && (size_t)w >= iov->iov_len; ++iov, --n) {
+            w -= iov->iov_len;
+        }
+        if (n) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + w;
+            iov->iov_len -= w;
+        }
+    }
+}
+
+inline void write_all(int fd, const char* p, size_t len) {
+    iovec iov = {const_cast<char*>(p), len};
+    write_all(fd, &iov, 1);
+}
+
+// pwrite() that retries until all of `p` is at `offset`.
+inline void pwrite_all(int fd, const char* p, size_t len, size_t offset) {
+    while (len) {
+        ssize_t w = pwrite(fd, p, len, offset);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("pwrite");
+            exit(1);
+        }
+        p += w;
+        len -= w;
+        offset += w;
+    }
+}
+
+// Reads the next buffer of a file on a background thread while the caller is
+// still parsing the current one.
+class prefetcher {
+    FILE* f;
+    size_t cap;
+    std::unique_ptr<char[]> back;
+    size_t backLen = 0;
+    bool ready = false;
+    bool stop = false;
+    std::mutex m;
+    std::condition_variable cv;
+    std::thread t;
+
+public:
+    prefetcher(FILE* f, size_t cap) : f(f), cap(cap), back(new char[cap]) {
+        t = std::thread([this] {
+            run();
+        });
+    }
+
+    ~prefetcher() {
+        {
+            std::lock_guard lock(m);
+            stop = true;
+        }
+        cv.notify_all();
+        t.join();
+    }
+
+    // Trades `buf` for the prefetched buffer and starts reading the next one.
+    // Returns the number of bytes now in `buf`, 0 at end of file.
+    size_t swap(std::unique_ptr<char[]>& buf) {
+        std::unique_lock lock(m);
+        cv.wait(lock, [this] {
+            return ready;
+        });
+        std::swap(buf, back);
+        size_t n = backLen;
+        ready = false;
+        lock.unlock();
+        cv.notify_all();
+        return n;
+    }
+
+private:
+    void run() {
+        std::unique_lock lock(m);
+        while (true) {
+            cv.wait(lock, [this] {
+                return !ready || stop;
+            });
+            if (stop)
+                return;
+
+            lock.unlock();
+            size_t n = fread(back.get(), 1, cap, f);
+            lock.lock();
+
+            backLen = n;
+            ready = true;
+            cv.notify_all();
+        }
+    }
+};
+
+// Writes full buffers of a file on a background thread so the caller can keep
+// filling the other one.
+class drainer {
+    int fd;
+    std::unique_ptr<char[]> back;
+    size_t backLen = 0;
+    bool stop = false;
+    std::mutex m;
+    std::condition_variable cv;
+    std::thread t;
+
+public:
+    drainer(int fd, size_t cap) : fd(fd), back(new char[cap]) {
+        t = std::thread([this] {
+            run();
+        });
+    }
+
+    // Waits for pending data to hit the file.
+    ~drainer() {
+        {
+            std::lock_guard lock(m);
+            stop = true;
+        }
+        cv.notify_all();
+        t.join();
+    }
+
+    // Blocks until everything handed over so far has been written.
+    void wait() {
+        std::unique_lock lock(m);
+        cv.wait(lock, [this] {
+            return backLen == 0;
+        });
+    }
+
+    // Trades the `len` bytes in `buf` for an empty buffer of the same size.
+    void swap(std::unique_ptr<char[]>& buf, size_t len) {
+        std::unique_lock lock(m);
+        cv.wait(lock, [this] {
+            return backLen == 0;
+        });
+        std::swap(buf, back);
+        backLen = len;
+        lock.unlock();
+        cv.notify_all();
+    }
+
+private:
+    void run() {
+        std::unique_lock lock(m);
+        while (true) {
+            cv.wait(lock, [this] {
+                return backLen != 0 || stop;
+            });
+            if (!backLen)
+                return;
+
+            lock.unlock();
+            write_all(fd, back.get(), backLen);
+            lock.lock();
+
+            backLen = 0;
+            cv.notify_all();
+        }
+    }
+};
@@ -0,0 +1,300 @@
+#include "options.hh"
+#include "proc.hh"
+#include "shared.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Runs gen and every sorter configuration over a range of dataset sizes and
+// prints one JSON object per run:
+//
+//   bench [--sizes=1e5,1e6,1e7,1e8] [--memory=64M] [--tmp=data] [--bin=DIR] [--verify]
+
+struct sorter {
+    std::string name;
+    std::vector<std::string> args;
+};
+
+struct measurement {
+    int status = 0;
+    double wall = 0;        // seconds
+    size_t rchar = 0;       // bytes read()/write() moved, from /proc/pid/io
+    size_t wchar = 0;
+    size_t readBytes = 0;   // bytes that actually hit the block device
+    size_t writeBytes = 0;
+    size_t passes = 0;      // "merge passes: N" from the sorter's stderr
+    long maxRss = 0;        // KiB
+};
+
+// Reads the counters of an exited but not yet reaped child.
+static void read_proc_io(pid_t pid, measurement& m) {
+    FILE* f = fopen(("/proc/" + std::to_string(pid) + "/io").c_str(), "r");
+    if (!f)
+        return;
+
+    char name[64];
+    size_t value;
+    while (fscanf(f, "%63[^:]: %zu\n", name, &value) == 2) {
+        std::string_view n = name;
+        if (n == "rchar")
+            m.rchar = value;
+        else if (n == "wchar")
+            m.wchar = value;
+        else if (n == "read_bytes")
+            m.readBytes = value;
+        else if (n == "write_bytes")
+            m.writeBytes = value;
+    }
+    fclose(f);
+}
+
+// Runs `args` with stdout discarded and stderr captured.
+static measurement run(const std::vector<std::string>& args) {
+    int err[2];
+    if (pipe(err) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        close(err[0]);
+        close(err[1]);
+        exec(args);
+    }
+
+    close(err[1]);
+    std::string log;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(err[0], buf, sizeof buf)) > 0) {
+        log.append(buf, n);
+    }
+    close(err[0]);
+
+    // WNOWAIT leaves the zombie around so /proc/pid/io is still there
+    measurement m;
+    siginfo_t info;
+    waitid(P_PID, pid, &info, WEXITED | WNOWAIT);
+    m.wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    read_proc_io(pid, m);
+
+    int status;
+    rusage usage;
+    wait4(pid, &status, 0, &usage);
+    m.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    m.maxRss = usage.ru_maxrss;
+
+    size_t at = log.rfind("merge passes: ");
+    if (at != std::string::npos)
+        m.passes = std::stoull(log.substr(at + 14));
+    if (m.status != 0)
+        std::cerr << log;
+    return m;
+}
+
+// Checks that keys in `path` never decrease.
+static bool is_sorted_file(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+
+    char* line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+    std::string prev, key;
+    bool ok = true;
+    while (ok && (len = getline(&line, &cap, f)) > 0) {
+        key.assign(line, std::min((size_t)len, KEY_SIZE));
+        ok = prev <= key;
+        prev.swap(key);
+    }
+    free(line);
+    fclose(f);
+    return ok;
+}
+
+// Accepts plain counts and "1e6" style powers of ten; false on anything else
+// and on overflow.
+static bool parse_count(std::string_view s, size_t& out) {
+    auto digits = [](std::string_view d, size_t& n) {
+        n = 0;
+        if (d.empty())
+            return false;
+        for (char c : d) {
+            if (c < '0' || c > '9')
+                return false;
+            if (__builtin_mul_overflow(n, 10, &n) || __builtin_add_overflow(n, c - '0', &n))
+                return false;
+        }
+        return true;
+    };
+
+    size_t e = s.find_first_of("eE");
+    if (!digits(s.substr(0, e), out))
+        return false;
+    if (e == std::string_view::npos)
+        return true;
+
+    size_t p;
+    if (!digits(s.substr(e + 1), p))
+        return false;
+    for (; p && out; --p) {
+        if (__builtin_mul_overflow(out, 10, &out))
+            return false;
+    }
+    return true;
+}
+
+// Comma separated parse_count() values, at least one.
+static bool parse_counts(std::string_view list, std::vector<size_t>& out) {
+    std::vector<size_t> counts;
+    std::stringstream ss{std::string(list)};
+    for (std::string s; getline(ss, s, ',');) {
+        size_t n;
+        if (!parse_count(s, n))
+            return false;
+        counts.push_back(n);
+    }
+    if (counts.empty() || list.back() == ',')
+        return false;
+    out = counts;
+    return true;
+}
+
+static std::string json_escape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+int main(int argc, char** argv) {
+    std::vector<size_t> sizes = {100'000, 1'000'000, 10'000'000, 100'000'000};
+    std::string memory = "64M";
+    std::string tmp = "data";
+    std::string bin = self_dir();
+    bool verify = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        std::string_view value;
+        size_t eq = arg.find('=');
+        if (eq != std::string_view::npos) {
+            value = arg.substr(eq + 1);
+            arg = arg.substr(0, eq);
+        }
+
+        size_t ignored;
+        if (arg == "--sizes" && parse_counts(value, sizes)) {
+        } else if (arg == "--memory" && parse_size(value, ignored)) {
+            memory = value;
+        } else if (arg == "--tmp" && !value.empty()) {
+            tmp = value;
+        } else if (arg == "--bin" && !value.empty()) {
+            bin = value;
+        } else if (arg == "--verify" && value.empty()) {
+            verify = true;
+        } else {
+            std::cerr << "usage: " << argv[0]
+                      << " [--sizes=1e5,1e6,...] [--memory=SIZE] [--tmp=DIR] [--bin=DIR] [--verify]\n";
+            return 1;
+        }
+    }
+    mkdir(tmp.c_str(), 0755);
+
+    std::string threads = "--threads=" + std::to_string(std::max(2u, std::thread::hardware_concurrency()));
+    std::vector<sorter> sorters = {
+        {"sort", {}},
+        {"sort", {"--merge=kway"}},
+        {"sort", {"--merge=polyphase"}},
+        {"sort_mod", {}},
+        {"sort_mod", {"--merge=kway"}},
+        {"sort_mod", {"--merge=polyphase"}},
+        {"sort_mod", {"--runs=replacement", "--merge=kway"}},
+        {"sort_mod", {"--merge=parallel", threads}},
+        {"sort_ai", {}},
+        {"sort_auto", {}},
+    };
+
+    std::string input = tmp + "/bench_in.txt";
+    std::string output = tmp + "/bench_out.txt";
+    bool first = true;
+    int failures = 0;
+
+    std::cout << "[\n";
+    for (size_t n : sizes) {
+        std::cerr << "generating " << n << " records\n";
+        measurement g = run({bin + "/gen", std::to_string(n), "--output=" + input});
+        if (g.status != 0) {
+            std::cerr << "gen failed\n";
+            return 1;
+        }
+        struct stat st;
+        size_t inputBytes = stat(input.c_str(), &st) == 0 ? st.st_size : 0;
+
+        for (const auto& s : sorters) {
+            std::vector<std::string> args = {
+                bin + "/" + s.name, "--input=" + input, "--output=" + output,
+                "--tmp=" + tmp, "--memory=" + memory,
+            };
+            args.insert(args.end(), s.args.begin(), s.args.end());
+
+            std::string flags;
+            for (const auto& a : s.args) {
+                flags += (flags.empty() ? "" : " ") + a;
+            }
+            std::cerr << s.name << (flags.empty() ? "" : " ") << flags << ": " << n << " records\n";
+
+            measurement m = run(args);
+            bool sorted = !verify || (m.status == 0 && is_sorted_file(output));
+            if (m.status != 0 || !sorted)
+                failures++;
+
+            std::cout << (first ? "" : ",\n") << "  {\"sorter\": \"" << s.name << "\", \"args\": \""
+                      << json_escape(flags) << "\", \"records\": " << n
+                      << ", \"input_bytes\": " << inputBytes << ", \"memory\": \"" << memory
+                      << "\", \"exit_status\": " << m.status << ", \"wall_s\": " << m.wall
+                      << ", \"bytes_read\": " << m.rchar << ", \"bytes_written\": " << m.wchar
+                      << ", \"disk_read\": " << m.readBytes << ", \"disk_written\": " << m.writeBytes
+                      << ", \"merge_passes\": " << m.passes << ", \"peak_rss_kb\": " << m.maxRss
+                      << ", \"records_per_s\": " << (m.wall > 0 ? n / m.wall : 0);
+            if (verify)
+                std::cout << ", \"sorted\": " << (sorted ? "true" : "false");
+            std::cout << "}";
+            std::cout.flush();
+            first = false;
+        }
+    }
+    std::cout << "\n]\n";
+
+    remove(input.c_str());
+    remove(output.c_str());
+    return failures ? 1 : 0;
+}
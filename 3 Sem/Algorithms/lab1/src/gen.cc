@@ -1,40 +1,264 @@
+#include "options.hh"
 #include "shared.hh"
 
-void generate(const std::string& path, size_t n) {
-    fast_writer w(path);
-    for (size_t i = 0; i < n; i++) {
-        record r;
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
-        r.key.clear();
-        for (int j = 0; j < 5; ++j) {
-            r.key += 'A' + (rand() % 26);
-        }
+enum class distribution {
+    uniform, // independent random keys
+    sorted,  // non-decreasing keys spread over the key space
+    reverse, // non-increasing
+    nearly,  // sorted, except `swaps` percent of records get the key of a random position
+    few,     // `distinct` keys repeated at random
+    zipf,    // key popularity ~ 1 / rank^skew
+    organ,   // ascending first half, descending second half
+};
 
-        std::string str;
-        for (int j = 0; j < rand() % 45 + 1; ++j) {
-            str += 'a' + (rand() % 26);
-        }
+struct gen_options {
+    size_t n = 16'000'000;
+    std::string path = "data/c.txt";
+    distribution dist = distribution::uniform;
+    size_t swaps = 1;     // percent, for nearly
+    size_t distinct = 16; // for few
+    double skew = 1.0;    // for zipf
+    uint64_t seed = 0;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+};
+
+static const uint64_t KEY_SPACE = 26ull * 26 * 26 * 26 * 26; // 5 letters
+
+// Counter-based RNG: record i draws from its own splitmix64 stream seeded by
+// (seed, i), so the output doesn't depend on which thread produced it.
+struct record_rng {
+    uint64_t state;
+
+    record_rng(uint64_t seed, uint64_t i) : state(seed ^ (i * 0xd1342543de82ef95ull)) {
+        next();
+    }
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t below(uint64_t n) {
+        return next() % n;
+    }
+
+    double unit() {
+        return (next() >> 11) * 0x1.0p-53;
+    }
+};
 
-        // E.164 compliant phone: + followed by 7-15 digits
-        int digit_count = 7 + (rand() % 9);
-        std::string phone = "+";
+// Rejection-inversion sampling of ranks 1..n with P(k) ~ k^-s (Hörmann and
+// Derflinger), constant time per sample for any n.
+class zipf_sampler {
+    double n, s;
+    double hX1, hN, sc;
 
-        for (int j = 0; j < digit_count; ++j) {
-            phone += '0' + (rand() % 10);
+    static double helper1(double x) {
+        return std::abs(x) > 1e-8 ? std::log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+    }
+
+    static double helper2(double x) {
+        return std::abs(x) > 1e-8 ? std::expm1(x) / x : 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+    }
+
+    double h(double x) const {
+        return std::exp(-s * std::log(x));
+    }
+
+    double hIntegral(double x) const {
+        double logX = std::log(x);
+        return helper2((1 - s) * logX) * logX;
+    }
+
+    double hIntegralInverse(double x) const {
+        double t = std::max(-1.0, x * (1 - s));
+        return std::exp(helper1(t) * x);
+    }
+
+public:
+    zipf_sampler(uint64_t n, double s) : n(n), s(s) {
+        hX1 = hIntegral(1.5) - 1;
+        hN = hIntegral(n + 0.5);
+        sc = 2 - hIntegralInverse(hIntegral(2.5) - h(2));
+    }
+
+    uint64_t operator()(record_rng& rng) const {
+        while (true) {
+            double u = hN + rng.unit() * (hX1 - hN);
+            double x = hIntegralInverse(u);
+            double k = std::clamp(std::floor(x + 0.5), 1.0, n);
+            if (k - x <= sc || u >= hIntegral(k + 0.5) - h(k))
+                return (uint64_t)k;
         }
+    }
+};
 
-        r.data = str + "\t" + phone;
-        w.write_record(r);
+// Key rank of record i, in [0, KEY_SPACE).
+static uint64_t key_rank(const gen_options& o, const zipf_sampler& zipf, size_t i, record_rng& rng) {
+    auto spread = [&](size_t pos, size_t count) {
+        return count ? (uint64_t)((unsigned __int128)pos * KEY_SPACE / count) : 0;
+    };
+
+    switch (o.dist) {
+    case distribution::uniform:
+        return rng.below(KEY_SPACE);
+    case distribution::sorted:
+        return spread(i, o.n);
+    case distribution::reverse:
+        return spread(o.n - 1 - i, o.n);
+    case distribution::nearly:
+        if (rng.below(100) < o.swaps)
+            return spread(rng.below(o.n), o.n);
+        return spread(i, o.n);
+    case distribution::few:
+        return spread(rng.below(o.distinct), o.distinct);
+    case distribution::zipf:
+        // scatter popular ranks over the key space; the multiplier is coprime to 26^5
+        return (zipf(rng) - 1) * 7'368'787 % KEY_SPACE;
+    case distribution::organ: {
+        size_t half = (o.n + 1) / 2;
+        return i < half ? spread(i, half) : spread(o.n - 1 - i, half);
+    }
     }
+    return 0;
+}
+
+static void format_record(const gen_options& o, const zipf_sampler& zipf, size_t i, std::string& out) {
+    record_rng rng(o.seed, i);
+
+    char key[KEY_SIZE];
+    uint64_t rank = key_rank(o, zipf, i, rng);
+    for (size_t j = KEY_SIZE; j-- > 0;) {
+        key[j] = 'A' + rank % 26;
+        rank /= 26;
+    }
+    out.append(key, KEY_SIZE);
+    out += '\t';
+
+    size_t len = rng.below(45) + 1;
+    for (size_t j = 0; j < len; ++j) {
+        out += 'a' + rng.below(26);
+    }
+
+    // E.164 compliant phone: + followed by 7-15 digits
+    out += "\t+";
+    size_t digitCount = 7 + rng.below(9);
+    for (size_t j = 0; j < digitCount; ++j) {
+        out += '0' + rng.below(10);
+    }
+    out += '\n';
+}
+
+// Threads format consecutive chunks of records side by side; the chunks are
+// written in order once the whole round is done.
+void generate(const gen_options& o) {
+    static const size_t CHUNK = 1 << 16;
+
+    fast_writer w(o.path);
+    zipf_sampler zipf(KEY_SPACE, o.skew);
+    std::vector<std::string> bufs(o.threads);
+
+    for (size_t round = 0; round < o.n; round += CHUNK * o.threads) {
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < o.threads; ++t) {
+            workers.emplace_back([&, t] {
+                size_t begin = std::min(o.n, round + t * CHUNK);
+                size_t end = std::min(o.n, begin + CHUNK);
+                bufs[t].clear();
+                for (size_t i = begin; i < end; ++i) {
+                    format_record(o, zipf, i, bufs[t]);
+                }
+            });
+        }
+        for (auto& t : workers) {
+            t.join();
+        }
+        for (const auto& b : bufs) {
+            write_all(w.fd, b.data(), b.size());
+        }
+    }
+}
+
+[[noreturn]] static void gen_usage(const char* prog) {
+    std::cerr << "usage: " << prog << " [N] [options]\n"
+              << "  N                            records (default: 16000000)\n"
+              << "  --output=PATH                - for stdout (default: data/c.txt)\n"
+              << "  --dist=uniform|sorted|reverse|nearly|few|zipf|organ\n"
+              << "                               key distribution (default: uniform)\n"
+              << "  --swaps=P                    nearly: percent of displaced records (default: 1)\n"
+              << "  --distinct=D                 few: number of distinct keys (default: 16)\n"
+              << "  --skew=S                     zipf: exponent (default: 1.0)\n"
+              << "  --seed=S                     RNG seed (default: 0)\n"
+              << "  --threads=N                  generator threads (default: all cores)\n";
+    exit(1);
 }
 
 int main(int argc, char** argv) {
-    srand(0);
+    gen_options o;
 
-    size_t n = 16'000'000;
-    if (argc > 1) {
-        n = std::stoull(argv[1]);
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        std::string_view value;
+
+        size_t eq = arg.find('=');
+        if (eq != std::string_view::npos) {
+            value = arg.substr(eq + 1);
+            arg = arg.substr(0, eq);
+        }
+
+        size_t number;
+        if (arg.substr(0, 2) != "--") {
+            if (!parse_size(arg, o.n))
+                gen_usage(argv[0]);
+        } else if (arg == "--output" && !value.empty()) {
+            o.path = value;
+        } else if (arg == "--dist") {
+            if (value == "uniform")
+                o.dist = distribution::uniform;
+            else if (value == "sorted")
+                o.dist = distribution::sorted;
+            else if (value == "reverse")
+                o.dist = distribution::reverse;
+            else if (value == "nearly")
+                o.dist = distribution::nearly;
+            else if (value == "few")
+                o.dist = distribution::few;
+            else if (value == "zipf")
+                o.dist = distribution::zipf;
+            else if (value == "organ")
+                o.dist = distribution::organ;
+            else
+                gen_usage(argv[0]);
+        } else if (arg == "--swaps" && parse_size(value, number) && number <= 100) {
+            o.swaps = number;
+        } else if (arg == "--distinct" && parse_size(value, number) && number >= 1) {
+            o.distinct = number;
+        } else if (arg == "--skew" && !value.empty()) {
+            std::string s(value);
+            char* end;
+            o.skew = strtod(s.c_str(), &end);
+            if (*end != '\0' || !std::isfinite(o.skew) || o.skew <= 0)
+                gen_usage(argv[0]);
+        } else if (arg == "--seed" && parse_size(value, number)) {
+            o.seed = number;
+        } else if (arg == "--threads" && parse_size(value, number) && number >= 1) {
+            o.threads = number;
+        } else {
+            gen_usage(argv[0]);
+        }
     }
 
-    generate("data/c.txt", n);
+    generate(o);
 }
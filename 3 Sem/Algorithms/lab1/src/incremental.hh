@@ -0,0 +1,124 @@
+#pragma once
+
+#include "mmap_io.hh"
+#include "options.hh"
+#include "planner.hh"
+#include "shared.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Incremental mode, for a sorted file that had unsorted records appended:
+// only the tail is sorted, then one streaming merge joins it with the prefix.
+
+// Sorted stretch that has to precede the earliest descent before the tail
+// search stops, unless the tail itself is longer.
+static const size_t MIN_PREFIX_CHECK = 1 << 20;
+
+// Where the unsorted tail of `path` starts, found from the end of the file so
+// that only about the tail is read: lines are walked backwards, each descent
+// moves the cut, and the walk stops once the sorted stretch before the cut is
+// as long as the tail (or at the start of the file). Returns the file size if
+// the file is sorted. Beyond the walked stretch this is a guess, which the merge
+// confirms.
+inline size_t find_tail(const std::string& path) {
+    mapped_file f(path);
+    const char* p = f.data();
+    size_t size = f.size();
+
+    size_t end = size && p[size - 1] == '\n' ? size - 1 : size; // of the current line
+    size_t cut = size;
+    std::string_view next; // key of the line after the current one
+    while (end > 0) {
+        const char* nl = static_cast<const char*>(memrchr(p, '\n', end));
+        size_t start = nl ? nl - p + 1 : 0;
+        std::string_view key(p + start, std::min(end - start, KEY_SIZE));
+        if (!next.empty() && next < key)
+            cut = end + 1;
+        if (cut - start >= std::max(MIN_PREFIX_CHECK, size - cut))
+            break;
+        next = key;
+        end = start ? start - 1 : 0;
+    }
+    return cut;
+}
+
+// Copies bytes [from, EOF) of `path` to `to`.
+inline void copy_tail(const std::string& path, size_t from, const std::string& to) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    fast_writer out(to);
+    std::unique_ptr<char[]> buf(new char[io.ibuf]);
+    ssize_t n;
+    while ((n = pread(fd, buf.get(), io.ibuf, from)) > 0) {
+        write_all(out.fd, buf.get(), n);
+        io_stats.bytesRead += n;
+        io_stats.bytesWritten += n;
+        from += n;
+    }
+    if (n < 0) {
+        perror("read");
+        exit(1);
+    }
+    close(fd);
+}
+
+// Sorts opts.input by sorting its unsorted tail with `sort` (a natural_merge_sort
+// taking options, in memory or external as the plan decides) and merging the
+// result with the sorted prefix in one pass. The merge checks that the prefix
+// really is one run; if the tail search guessed wrong, everything goes through
+// `sort` after all. Returns the number of merge passes.
+template <typename Reader = fast_reader, typename Writer = fast_writer, typename Sort>
+size_t incremental_sort(const options& opts, Sort sort) {
+    const std::string& input = opts.input;
+    const std::string& output = opts.output;
+
+    size_t size = input_size(input);
+    size_t cut = find_tail(input);
+    std::cerr << "incremental: sorted prefix of " << cut << " bytes, tail of " << size - cut << " bytes\n";
+
+    options tail = opts;
+    tail.input = tail.output = opts.temp("tail.txt");
+    metrics.begin();
+    copy_tail(input, cut, tail.input);
+    metrics.end("tail", 0, 1);
+    size_t passes = cut == size ? 0 : sort(tail);
+    size_t tailBytes = input_size(tail.input);
+
+    // the merge reads the input, so it can't write over it; stdout can't be
+    // taken back if the check fails
+    bool direct = !same_file(input, output) && output != "-";
+    std::string target = direct ? output : opts.temp("work.txt");
+
+    bool ok;
+    metrics.begin();
+    {
+        basic_run_reader<Reader> prefix(input), rest(tail.input);
+        Writer w(target);
+        merge_run(prefix, rest, w);
+        ok = (!prefix.has_value() || prefix.at_boundary()) && w.offset() == cut + tailBytes;
+    }
+    metrics.end("merge", 2, 1);
+    remove(tail.input.c_str());
+
+    if (!ok) {
+        std::cerr << "incremental: the prefix isn't sorted, sorting everything\n";
+        if (!direct)
+            remove(target.c_str());
+        return sort(opts);
+    }
+    if (!direct)
+        move_file(target, output);
+    return passes + 1;
+}
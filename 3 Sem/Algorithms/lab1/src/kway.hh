@@ -0,0 +1,113 @@
+#pragma once
+
+#include "loser_tree.hh"
+#include "shared.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Splits natural runs of `source` round-robin over `outputs`.
+template <typename Reader = fast_reader, typename Writer = fast_writer>
+size_t distribute_k(const std::string& source, const std::vector<std::string>& outputs) {
+    run_writers<Writer> w(outputs);
+    return distribute_runs<Reader>(source, w);
+}
+
+// Merges the i-th run of every input into the i-th run of `out`.
+template <typename Reader = fast_reader, typename Writer = fast_writer>
+size_t merge_k(const std::vector<std::string>& inputs, const std::string& out) {
+    std::vector<std::unique_ptr<basic_run_reader<Reader>>> readers;
+    for (const auto& p : inputs) {
+        readers.push_back(std::make_unique<basic_run_reader<Reader>>(p));
+    }
+    Writer w(out);
+
+    auto active = [&](size_t i) {
+        return readers[i]->has_value() && !readers[i]->at_boundary();
+    };
+    auto less = [&](size_t i, size_t j) {
+        if (!active(i))
+            return false;
+        if (!active(j))
+            return true;
+        return readers[i]->peek() < readers[j]->peek();
+    };
+    auto any_left = [&] {
+        return std::any_of(readers.begin(), readers.end(), [](const auto& r) {
+            return r->has_value();
+        });
+    };
+
+    loser_tree tree(readers.size(), less);
+    size_t run_count = 0;
+
+    while (any_left()) {
+        run_count++;
+
+        // merge one run
+        tree.rebuild();
+        for (;;) {
+            size_t i = tree.top();
+            if (!active(i))
+                break;
+            w.write_record(readers[i]->peek());
+            readers[i]->consume();
+            tree.replay(i);
+        }
+
+        for (auto& r : readers) {
+            if (r->at_boundary())
+                r->clear_boundary();
+        }
+    }
+
+    return run_count;
+}
+
+// Natural merge sort with a k-way merge: every distribute/merge pair divides the
+// number of runs by k instead of 2. Intermediate passes go through `work`; the
+// pass that is known to leave a single run writes straight to `output`, so
+// neither end has to be a seekable file. `inputRuns` is the number of runs a
+// previous merge left in `input`, 0 if unknown; it only goes to the metrics.
+// Returns the number of merge passes.
+template <typename Reader = fast_reader, typename Writer = fast_writer>
+size_t kway_merge_sort(
+    const std::string& input,
+    const std::string& output,
+    const std::vector<std::string>& temps,
+    const std::string& work,
+    size_t inputRuns = 0
+) {
+    std::string src = input;
+    size_t passes = 0;
+    size_t merged = inputRuns;
+    while (true) {
+        metrics.begin();
+        size_t runs = distribute_k<Reader, Writer>(src, temps);
+        metrics.end("distribute", merged, runs);
+        if (runs <= 1) {
+            if (!same_file(src, output))
+                move_file(temps[0], output);
+            return passes;
+        }
+
+        // at most one run per file, the merge produces the result
+        passes++;
+        metrics.begin();
+        if (runs <= temps.size()) {
+            metrics.end("merge", runs, merge_k<Reader, Writer>(temps, output));
+            return passes;
+        }
+
+        merged = merge_k<Reader, Writer>(temps, work);
+        metrics.end("merge", runs, merged);
+        if (merged <= 1) {
+            move_file(work, output);
+            return passes;
+        }
+        src = work;
+    }
+}
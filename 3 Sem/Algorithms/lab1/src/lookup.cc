@@ -0,0 +1,141 @@
+#include "shared.hh"
+#include "sparse_index.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/stat.h>
+
+// Prints the records of a sorted file with the given keys, using the sparse
+// index written by `sort --index`:
+//
+//   lookup [--file=data/c.txt] KEY...
+//
+// Exits with 1 if some key wasn't found, like grep.
+
+struct sparse_index {
+    size_t keySize = 0;
+    size_t fileSize = 0;
+    std::vector<char> entries;
+
+    size_t size() const {
+        return entries.size() / (keySize + 8);
+    }
+
+    std::string_view key(size_t i) const {
+        return std::string_view(entries.data() + i * (keySize + 8), keySize);
+    }
+
+    size_t offset(size_t i) const {
+        uint64_t off;
+        memcpy(&off, entries.data() + i * (keySize + 8) + keySize, 8);
+        return off;
+    }
+
+    // Where lines with `key` may start: the last entry with a smaller key, so
+    // that equal keys spilling over from the block before aren't missed.
+    size_t seek(std::string_view k) const {
+        size_t lo = 0, hi = size();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (key(mid) < k)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo ? offset(lo - 1) : 0;
+    }
+};
+
+static sparse_index load_index(const std::string& path) {
+    FILE* f = fopen(index_path(path).c_str(), "rb");
+    if (!f) {
+        std::cerr << "no index for " << path << ", sort it with --index\n";
+        exit(2);
+    }
+
+    char header[INDEX_HEADER];
+    sparse_index idx;
+    if (fread(header, 1, sizeof header, f) != sizeof header || memcmp(header, INDEX_MAGIC, 4) != 0) {
+        std::cerr << index_path(path) << ": not an index\n";
+        exit(2);
+    }
+    uint32_t k;
+    uint64_t n;
+    memcpy(&k, header + 4, 4);
+    memcpy(&n, header + 16, 8);
+    idx.keySize = k;
+    idx.fileSize = n;
+
+    char buf[1 << 16];
+    while (size_t got = fread(buf, 1, sizeof buf, f)) {
+        idx.entries.insert(idx.entries.end(), buf, buf + got);
+    }
+    fclose(f);
+
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) {
+        perror("stat");
+        exit(2);
+    }
+    if ((size_t)st.st_size != idx.fileSize) {
+        std::cerr << index_path(path) << " is stale, sort " << path << " with --index again\n";
+        exit(2);
+    }
+    return idx;
+}
+
+int main(int argc, char** argv) {
+    std::string path = "data/c.txt";
+    std::vector<std::string> keys;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg.substr(0, 7) == "--file=" && arg.size() > 7) {
+            path = arg.substr(7);
+        } else if (arg.substr(0, 2) == "--" || arg.empty()) {
+            std::cerr << "usage: " << argv[0] << " [--file=PATH] KEY...\n";
+            return 2;
+        } else {
+            keys.emplace_back(arg);
+        }
+    }
+
+    sparse_index idx = load_index(path);
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        perror("open");
+        return 2;
+    }
+
+    char* line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+    bool missing = false;
+    for (const auto& k : keys) {
+        std::string key = k.substr(0, idx.keySize);
+        key.resize(idx.keySize, ' '); // keys are stored padded, like fast_writer does
+
+        fseeko(f, idx.seek(key), SEEK_SET);
+        bool found = false;
+        while ((len = getline(&line, &cap, f)) > 0) {
+            std::string_view l(line, len);
+            std::string_view lk = l.substr(0, std::min(l.size(), idx.keySize));
+            if (lk > key)
+                break;
+            if (lk == key) {
+                fwrite(line, 1, len, stdout);
+                found = true;
+            }
+        }
+        missing |= !found;
+    }
+    free(line);
+    fclose(f);
+    return missing ? 1 : 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Tournament tree of losers over k leaves. Each internal node keeps the leaf that
+// lost the match played there, so after the winner's value changes only the
+// log2(k) matches on its path to the root are replayed.
+//
+// `less(i, j)` must return true when leaf i beats leaf j. Exhausted leaves have
+// to lose against everything, including other exhausted leaves.
+template <typename Less>
+class loser_tree {
+    size_t k;
+    Less less;
+    std::vector<size_t> tree; // tree[0] - overall winner, tree[1..k-1] - losers
+public:
+    loser_tree(size_t k, Less less) : k(k), less(less), tree(k) {
+        rebuild();
+    }
+
+    size_t top() const {
+        return tree[0];
+    }
+
+    // Plays every match from scratch, e.g. when all leaves changed at once.
+    void rebuild() {
+        // leaf i sits at node k + i, node n has children 2n and 2n + 1
+        std::vector<size_t> winner(k);
+        auto at = [&](size_t node) {
+            return node >= k ? node - k : winner[node];
+        };
+
+        for (size_t node = k - 1; node > 0; --node) {
+            size_t l = at(2 * node);
+            size_t r = at(2 * node + 1);
+            if (less(r, l))
+                std::swap(l, r);
+            winner[node] = l;
+            tree[node] = r;
+        }
+
+        tree[0] = k > 1 ? winner[1] : 0;
+    }
+
+    // Replays the matches on the path of `leaf`, normally the previous winner.
+    void replay(size_t leaf) {
+        size_t winner = leaf;
+        for (size_t node = (leaf + k) / 2; node > 0; node /= 2) {
+            if (less(tree[node], winner))
+                std::swap(tree[node], winner);
+        }
+        tree[0] = winner;
+    }
+};
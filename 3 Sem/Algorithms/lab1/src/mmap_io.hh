@@ -0,0 +1,305 @@
+#pragma once
+
+#include "shared.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only mapping of a whole file.
+class mapped_file {
+    int fd;
+    const char* base = nullptr;
+    size_t len = 0;
+
+public:
+    mapped_file(const std::string& path) {
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            perror("open");
+            exit(1);
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            perror("fstat");
+            exit(1);
+        }
+        len = st.st_size;
+        if (!len)
+            return;
+
+        void* p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        base = static_cast<const char*>(p);
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file() {
+        if (base)
+            munmap(const_cast<char*>(base), len);
+        close(fd);
+    }
+
+    const char* data() const {
+        return base;
+    }
+
+    size_t size() const {
+        return len;
+    }
+
+    int descriptor() const {
+        return fd;
+    }
+};
+
+// Reads records straight out of a read-only mapping of the whole file. The
+// returned views stay valid for the lifetime of the reader, so callers can keep
+// them around (e.g. as the previous record of a run) without copying.
+class mmap_reader {
+    static constexpr size_t WILLNEED_STEP = 8 << 20;
+
+    mapped_file file;
+    const char* base;
+    size_t size;
+    size_t pos = 0;
+    size_t prefetched = 0;
+
+public:
+    using record_type = record_view;
+
+    mmap_reader(const std::string& path) : file(path), base(file.data()), size(file.size()) {
+        if (!size)
+            return;
+
+        // sequential: bigger readahead, pages behind us are dropped first
+        posix_fadvise(file.descriptor(), 0, 0, POSIX_FADV_SEQUENTIAL);
+        madvise(const_cast<char*>(base), size, MADV_SEQUENTIAL);
+        prefetch();
+    }
+
+    ~mmap_reader() {
+        io_stats.bytesRead += std::min(pos, size);
+    }
+
+    bool next_record(record_view& out) {
+        if (pos + KEY_SIZE >= size)
+            return false;
+
+        const char* key = base + pos;
+        if (memchr(key, '\n', KEY_SIZE) || key[KEY_SIZE] != '\t')
+            return false;
+
+        const char* data = key + KEY_SIZE + 1;
+        const char* end = static_cast<const char*>(memchr(data, '\n', base + size - data));
+        if (!end)
+            end = base + size;
+
+        out.key = std::string_view(key, KEY_SIZE);
+        out.data = std::string_view(data, end - data);
+        out.packed = pack_key(out.key);
+        pos = end - base + 1;
+
+        if (pos >= prefetched)
+            prefetch();
+        return true;
+    }
+
+    // Adds the next record to the batch as a view into the mapping; a batch is
+    // filled either this way or through its arena, never both.
+    bool next_record(record_batch& b) {
+        record_view r;
+        if (!next_record(r))
+            return false;
+        if (b.entries.empty())
+            b.external = r.key.data();
+        size_t offset = r.key.data() - b.external;
+        size_t size = r.data.data() + r.data.size() - r.key.data();
+        b.entries.push_back({r.packed, (uint32_t)offset, (uint32_t)size});
+        return true;
+    }
+
+    // Appends about `max_bytes` of records to `b`, tokenizing the mapping in
+    // place with record_batch::index_lines().
+    bool append_batch(record_batch& b, size_t max_bytes = BATCH_BYTES) {
+        scoped_timer t(io_stats.parseNanos);
+        size_t before = b.size();
+        size_t target = b.bytes() + max_bytes;
+
+        while (pos < size && b.bytes() < target) {
+            if (b.entries.empty())
+                b.external = base + pos;
+
+            const char* p = base + pos;
+            size_t avail = std::min(size - pos, target - b.bytes());
+            const char* nl = static_cast<const char*>(memrchr(p, '\n', avail));
+            if (!nl) {
+                // a line longer than what's left of the budget, or the last one
+                if (!next_record(b))
+                    break;
+                continue;
+            }
+
+            size_t from = p - b.external;
+            size_t to = nl + 1 - b.external;
+            size_t good = b.index_lines(from, to);
+            pos += good - from;
+            if (good != to)
+                break;
+        }
+
+        if (pos >= prefetched)
+            prefetch();
+        return b.size() > before;
+    }
+
+    bool next_batch(record_batch& b, size_t max_bytes = BATCH_BYTES) {
+        b.clear();
+        return append_batch(b, max_bytes);
+    }
+
+private:
+    // Keeps one step of readahead in flight ahead of the parser.
+    void prefetch() {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t from = std::max(prefetched, pos) / page * page;
+        if (from >= size)
+            return;
+        size_t len = std::min(WILLNEED_STEP, size - from);
+        madvise(const_cast<char*>(base) + from, len, MADV_WILLNEED);
+        prefetched = from + len;
+    }
+};
+
+// Writes records through a shared mapping that slides over the file in
+// WINDOW-sized steps; the file is truncated to the bytes written on close.
+class mmap_writer {
+    static constexpr size_t WINDOW = 64 << 20;
+
+    int fd;
+    char* map = nullptr;
+    size_t map_off = 0; // file offset of the window
+    size_t map_len = 0;
+    size_t pos = 0; // write position inside the window
+    size_t records = 0;
+    std::unique_ptr<index_builder> index;
+
+public:
+    mmap_writer(const std::string& path) : index(index_for(path, KEY_SIZE)) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("open");
+            exit(1);
+        }
+    }
+
+    mmap_writer(const mmap_writer&) = delete;
+    mmap_writer& operator=(const mmap_writer&) = delete;
+
+    size_t offset() const {
+        return map_off + pos;
+    }
+
+    ~mmap_writer() {
+        size_t written = map_off + pos;
+        io_stats.bytesWritten += written;
+        io_stats.records += records;
+        if (map)
+            munmap(map, map_len);
+        if (ftruncate(fd, written) < 0)
+            perror("ftruncate");
+        close(fd);
+        if (index) {
+            index->write(written);
+            indexed.fresh = true;
+        }
+    }
+
+    template <typename Record>
+    void write_record(const Record& r) {
+        if (index)
+            index->add(r.key, offset());
+        records++;
+        size_t n = KEY_SIZE + 1 + r.data.size() + 1;
+        if (pos + n > map_len)
+            remap(n);
+
+        char* p = map + pos;
+        size_t k = std::min(r.key.size(), KEY_SIZE);
+        memcpy(p, r.key.data(), k);
+        memset(p + k, ' ', KEY_SIZE - k);
+        p[KEY_SIZE] = '\t';
+        memcpy(p + KEY_SIZE + 1, r.data.data(), r.data.size());
+        p[n - 1] = '\n';
+        pos += n;
+    }
+
+    template <typename Order>
+    void write_batch(const record_batch& b, const Order& order) {
+        records += b.size();
+        for (const auto& e : order) {
+            std::string_view line = b.line(e.index);
+            if (index)
+                index->add(b.key(e.index), offset());
+            if (pos + line.size() + 1 > map_len)
+                remap(line.size() + 1);
+            memcpy(map + pos, line.data(), line.size());
+            map[pos + line.size()] = '\n';
+            pos += line.size() + 1;
+        }
+    }
+
+    void write_lines(const record_batch& b, size_t from, size_t to) {
+        if (from == to)
+            return;
+        records += to - from;
+        for (size_t i = from; index && i < to; ++i) {
+            index->add(b.key(i), offset() + b.entries[i].offset - b.entries[from].offset);
+        }
+        std::string_view span = b.lines(from, to);
+        if (pos + span.size() + 1 > map_len)
+            remap(span.size() + 1);
+        memcpy(map + pos, span.data(), span.size());
+        map[pos + span.size()] = '\n';
+        pos += span.size() + 1;
+    }
+
+private:
+    void remap(size_t need) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t written = map_off + pos;
+        if (map)
+            munmap(map, map_len);
+
+        map_off = written / page * page;
+        pos = written - map_off;
+        map_len = std::max(WINDOW, (pos + need + page - 1) / page * page);
+
+        if (ftruncate(fd, map_off + map_len) < 0) {
+            perror("ftruncate");
+            exit(1);
+        }
+        void* p = mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, map_off);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        map = static_cast<char*>(p);
+        madvise(map, map_len, MADV_SEQUENTIAL);
+    }
+};
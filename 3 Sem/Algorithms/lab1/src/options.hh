@@ -0,0 +1,223 @@
+#pragma once
+
+#include "async_io.hh"
+#include "shared.hh"
+#include "stats.hh"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+enum class run_strategy {
+    block,       // sort fixed-size blocks in memory
+    replacement, // replacement selection, runs ~2x the memory size on random input
+};
+
+enum class merge_strategy {
+    two_way,   // balanced merge over two temp files
+    kway,      // loser tree over as many files as the memory budget allows
+    polyphase, // Fibonacci distribution, no distribution pass between merges
+    parallel,  // one pass over all runs, split into key ranges across threads
+};
+
+struct options {
+    run_strategy runs = run_strategy::block;
+    merge_strategy merge = merge_strategy::two_way;
+    size_t memory = 64 << 20;
+    size_t tapes = 0; // polyphase tape count, 0 - derived from memory
+    bool mmap = false;
+    bool incremental = false;
+    size_t top = 0;        // keep only the `top` smallest records, 0 - all
+    key_range range;       // keep only these keys
+    size_t partitions = 0; // split the output into this many key ranges, 0 - one file
+    size_t threads = 1;
+    std::string input = "data/c.txt"; // "-" - stdin
+    std::string output;               // "-" - stdout, empty - same as input
+    std::string tmp = "data";         // directory for temp runs
+    std::string stats;                // per-pass JSON lines, "-" - stderr
+
+    std::string temp(const std::string& name) const {
+        return tmp + "/" + name;
+    }
+
+    // Temp run file, e.g. run_file("a") - tmp/a.txt, or tmp/a.run with --compress.
+    std::string run_file(const std::string& name) const {
+        return temp(name + io.run_suffix());
+    }
+
+    // File for intermediate merge passes: the output itself unless that's stdout.
+    std::string work() const {
+        return output == "-" ? temp("work.txt") : output;
+    }
+};
+
+// Parses sizes like "4096", "512K", "64M" or "2G". Sizes that don't fit in
+// size_t are rejected rather than wrapped.
+inline bool parse_size(std::string_view s, size_t& out) {
+    size_t mult = 1;
+    if (!s.empty()) {
+        switch (s.back()) {
+        case 'K':
+        case 'k':
+            mult = 1 << 10;
+            break;
+        case 'M':
+        case 'm':
+            mult = 1 << 20;
+            break;
+        case 'G':
+        case 'g':
+            mult = 1 << 30;
+            break;
+        }
+        if (mult != 1)
+            s.remove_suffix(1);
+    }
+    if (s.empty())
+        return false;
+
+    size_t n = 0;
+    for (char c : s) {
+        if (c < '0' || c > '9')
+            return false;
+        if (__builtin_mul_overflow(n, 10, &n) || __builtin_add_overflow(n, c - '0', &n))
+            return false;
+    }
+    return !__builtin_mul_overflow(n, mult, &out);
+}
+
+[[noreturn]] inline void usage(const char* prog) {
+    std::cerr << "usage: " << prog << " [options]\n"
+              << "  --runs=block|replacement     run generation strategy (default: block)\n"
+              << "  --merge=2way|kway|polyphase|parallel\n"
+              << "                               merge strategy (default: 2way)\n"
+              << "  --memory=SIZE                memory budget, e.g. 64M (default: 64M)\n"
+              << "  --tapes=N                    polyphase temp files (default: from memory)\n"
+              << "  --mmap                       zero-copy memory-mapped I/O\n"
+              << "  --async                      overlap parsing with reads/writes\n"
+              << "  --compress                   pack temp runs: front-coded keys, LZ payloads\n"
+              << "  --threads=N                  sort/merge on N threads (default: 1)\n"
+              << "  --incremental                sort only the unsorted tail, merge it into the\n"
+              << "                               sorted prefix\n"
+              << "  --top=K                      output only the K smallest records\n"
+              << "  --index[=STEP]               write a sparse index OUTPUT.idx with a key every\n"
+              << "                               STEP bytes (default: 4K), see lookup\n"
+              << "  --from=KEY, --to=KEY         output only keys in [from, to]\n"
+              << "  --partitions=P               write P files OUTPUT.0.. of consecutive key ranges\n"
+              << "                               and a manifest OUTPUT.manifest\n"
+              << "  --input=PATH                 file to sort, - for stdin (default: data/c.txt)\n"
+              << "  --output=PATH                sorted file, - for stdout (default: in place,\n"
+              << "                               stdout when reading stdin)\n"
+              << "  --tmp=DIR                    directory for temp runs (default: data)\n"
+              << "  --stats[=PATH]               per-pass metrics as JSON lines (default: stderr)\n";
+    exit(1);
+}
+
+inline options parse_options(int argc, char** argv) {
+    options opts;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        std::string_view value;
+
+        size_t eq = arg.find('=');
+        if (eq != std::string_view::npos) {
+            value = arg.substr(eq + 1);
+            arg = arg.substr(0, eq);
+        }
+
+        if (arg == "--runs") {
+            if (value == "block")
+                opts.runs = run_strategy::block;
+            else if (value == "replacement")
+                opts.runs = run_strategy::replacement;
+            else
+                usage(argv[0]);
+        } else if (arg == "--merge") {
+            if (value == "2way")
+                opts.merge = merge_strategy::two_way;
+            else if (value == "kway")
+                opts.merge = merge_strategy::kway;
+            else if (value == "polyphase")
+                opts.merge = merge_strategy::polyphase;
+            else if (value == "parallel")
+                opts.merge = merge_strategy::parallel;
+            else
+                usage(argv[0]);
+        } else if (arg == "--memory") {
+            if (!parse_size(value, opts.memory))
+                usage(argv[0]);
+        } else if (arg == "--mmap" && value.empty()) {
+            opts.mmap = true;
+        } else if (arg == "--async" && value.empty()) {
+            io.async = true;
+        } else if (arg == "--compress" && value.empty()) {
+            io.compress = true;
+        } else if (arg == "--incremental" && value.empty()) {
+            opts.incremental = true;
+        } else if (arg == "--top") {
+            if (!parse_size(value, opts.top) || opts.top < 1)
+                usage(argv[0]);
+        } else if (arg == "--index") {
+            indexed.path = "-"; // the output, once it's known
+            if (!value.empty() && (!parse_size(value, indexed.step) || indexed.step < 1))
+                usage(argv[0]);
+        } else if (arg == "--from" && !value.empty()) {
+            opts.range.from = value;
+        } else if (arg == "--to" && !value.empty()) {
+            opts.range.to = value;
+        } else if (arg == "--partitions") {
+            if (!parse_size(value, opts.partitions) || opts.partitions < 1)
+                usage(argv[0]);
+        } else if (arg == "--threads") {
+            if (!parse_size(value, opts.threads) || opts.threads < 1)
+                usage(argv[0]);
+        } else if (arg == "--tapes") {
+            if (!parse_size(value, opts.tapes) || opts.tapes < 3)
+                usage(argv[0]);
+        } else if (arg == "--input" && !value.empty()) {
+            opts.input = value;
+        } else if (arg == "--output" && !value.empty()) {
+            opts.output = value;
+        } else if (arg == "--tmp" && !value.empty()) {
+            opts.tmp = value;
+        } else if (arg == "--stats") {
+            opts.stats = value.empty() ? "-" : value;
+            metrics.open(opts.stats);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (opts.output.empty())
+        opts.output = opts.input;
+    if (!indexed.path.empty() && opts.output == "-") {
+        std::cerr << "--index needs a file as output\n";
+        exit(1);
+    }
+    if (!indexed.path.empty())
+        indexed.path = opts.output;
+    if (opts.mmap && (opts.input == "-" || opts.output == "-")) {
+        std::cerr << "--mmap needs a file for both input and output\n";
+        exit(1);
+    }
+    if (opts.incremental && (opts.top || !opts.range.all())) {
+        std::cerr << "--incremental sorts the whole file, it can't be combined with --top/--from/--to\n";
+        exit(1);
+    }
+    if (opts.incremental && opts.input == "-") {
+        std::cerr << "--incremental needs a file as input\n";
+        exit(1);
+    }
+    if (opts.partitions && (opts.output == "-" || opts.top || opts.incremental || !indexed.path.empty())) {
+        std::cerr << "--partitions needs a file as output, it can't be combined with --top/--incremental/--index\n";
+        exit(1);
+    }
+    if (opts.mmap && io.compress) {
+        std::cerr << "--mmap and --compress don't mix: packed runs can't be mapped\n";
+        exit(1);
+    }
+
+    return opts;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string_view>
+
+// Normalized key: the first 7 bytes big-endian in the high bits and the length
+// (capped at 8) in the low byte. For keys up to 7 bytes, comparing packed keys
+// as integers gives exactly the lexicographic order, so e.g. the 5-byte keys of
+// our data sets compare with a single instruction.
+//
+// Longer keys with the same 7-byte prefix pack equal and fall back to a full
+// comparison in key_less.
+inline uint64_t pack_key(std::string_view k) {
+    uint64_t v = 0;
+    size_t n = std::min(k.size(), (size_t)7);
+    for (size_t i = 0; i < n; ++i) {
+        v |= (uint64_t)(unsigned char)k[i] << (56 - 8 * i);
+    }
+    return v | std::min(k.size(), (size_t)8);
+}
+
+inline bool key_less(uint64_t pa, std::string_view a, uint64_t pb, std::string_view b) {
+    if (pa != pb)
+        return pa < pb;
+    return (pa & 0xff) == 8 && a < b;
+}
@@ -0,0 +1,250 @@
+#pragma once
+
+#include "loser_tree.hh"
+#include "mmap_io.hh"
+#include "shared.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Start of the line containing `p`, not earlier than `begin`.
+inline const char* line_start(const char* begin, const char* p) {
+    const void* nl = memrchr(begin, '\n', p - begin);
+    return nl ? static_cast<const char*>(nl) + 1 : begin;
+}
+
+inline std::string_view line_key(const char* line) {
+    return std::string_view(line, KEY_SIZE);
+}
+
+// First line of the sorted run [begin, end) whose key is not less than `key`.
+inline const char* lower_bound_line(const char* begin, const char* end, std::string_view key) {
+    const char* lo = begin;
+    const char* hi = end;
+    while (lo < hi) {
+        const char* mid = lo + (hi - lo) / 2;
+        const char* line = line_start(lo, mid);
+        if (line_key(line) < key) {
+            const char* nl = static_cast<const char*>(memchr(mid, '\n', end - mid));
+            lo = nl ? nl + 1 : end;
+        } else {
+            hi = line;
+        }
+    }
+    return lo;
+}
+
+// One key range of a parallel merge: keys in [from, to), an empty bound is open.
+struct merged_range {
+    std::string from, to;
+    size_t records = 0;
+    size_t bytes = 0;
+};
+
+// Merges sorted runs split into `parts` key ranges on `threads` threads,
+// sample-sort style.
+//
+// Splitter keys are sampled from every run, and each splitter is located in
+// every run by binary search. A thread then merges key range t of all runs.
+// Range t goes to outs[t], or, with a single output, to its segment of outs[0]:
+// records are copied verbatim, so the output size of every range is known up
+// front and each thread writes its segment with pwrite at a precomputed offset.
+inline std::vector<merged_range> merge_ranges(
+    const std::vector<std::string>& files,
+    const std::vector<run_span>& runs,
+    const std::vector<std::string>& outs,
+    size_t parts,
+    size_t threads
+) {
+    static const size_t SAMPLES_PER_PART = 256;
+    static const size_t SEGMENT_BUF = 1 << 20;
+
+    if (runs.empty()) {
+        for (const auto& out : outs) {
+            fclose(fopen(out.c_str(), "wb"));
+        }
+        return std::vector<merged_range>(outs.size());
+    }
+
+    std::vector<std::unique_ptr<mapped_file>> maps;
+    for (const auto& f : files) {
+        maps.push_back(std::make_unique<mapped_file>(f));
+    }
+
+    auto run_begin = [&](const run_span& r) {
+        return maps[r.file]->data() + r.begin;
+    };
+    auto run_end = [&](const run_span& r) {
+        return maps[r.file]->data() + r.end;
+    };
+
+    // a sample from the middle of every slice of every run, as many as the run's
+    // share of the bytes, so that short runs (the last one, replacement
+    // selection's) don't skew the split
+    size_t total = 0;
+    for (const auto& r : runs) {
+        total += r.end - r.begin;
+    }
+    std::vector<std::string_view> samples;
+    for (const auto& r : runs) {
+        size_t perRun = parts > 1 ? SAMPLES_PER_PART * parts * (r.end - r.begin) / std::max(total, (size_t)1) + 1 : 0;
+        for (size_t i = 0; i < perRun; ++i) {
+            const char* p = run_begin(r) + (r.end - r.begin) * (2 * i + 1) / (2 * perRun);
+            samples.push_back(line_key(line_start(run_begin(r), p)));
+        }
+    }
+    std::sort(samples.begin(), samples.end());
+
+    std::vector<std::string_view> splitters;
+    for (size_t t = 1; t < parts; ++t) {
+        splitters.push_back(samples[samples.size() * t / parts]);
+    }
+
+    // cut[t][r] - where range t starts in run r
+    std::vector<std::vector<const char*>> cut(parts + 1, std::vector<const char*>(runs.size()));
+    std::vector<size_t> offset(parts + 1, 0);
+    for (size_t r = 0; r < runs.size(); ++r) {
+        cut[0][r] = run_begin(runs[r]);
+        cut[parts][r] = run_end(runs[r]);
+        for (size_t t = 1; t < parts; ++t) {
+            cut[t][r] = lower_bound_line(cut[t - 1][r], run_end(runs[r]), splitters[t - 1]);
+        }
+    }
+    for (size_t t = 0; t < parts; ++t) {
+        offset[t + 1] = offset[t];
+        for (size_t r = 0; r < runs.size(); ++r) {
+            offset[t + 1] += cut[t + 1][r] - cut[t][r];
+        }
+    }
+
+    bool single = outs.size() == 1;
+    std::vector<int> fds;
+    for (size_t i = 0; i < outs.size(); ++i) {
+        int fd = open(outs[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("open");
+            exit(1);
+        }
+        if (outs[i] == indexed.path)
+            indexed.fresh = false; // written in parallel, finish_index() reads it back
+        if (ftruncate(fd, single ? offset[parts] : offset[i + 1] - offset[i]) < 0) {
+            perror("ftruncate");
+            exit(1);
+        }
+        fds.push_back(fd);
+    }
+
+    std::vector<merged_range> ranges(parts);
+    auto merge_range = [&](size_t t) {
+        struct cursor {
+            const char* p;
+            const char* end;
+        };
+        std::vector<cursor> in;
+        for (size_t r = 0; r < runs.size(); ++r) {
+            in.push_back({cut[t][r], cut[t + 1][r]});
+        }
+
+        auto less = [&](size_t i, size_t j) {
+            if (in[i].p == in[i].end)
+                return false;
+            if (in[j].p == in[j].end)
+                return true;
+            // runs are in input order, so ties going to the earlier one keep the merge stable
+            int c = line_key(in[i].p).compare(line_key(in[j].p));
+            return c < 0 || (c == 0 && i < j);
+        };
+        loser_tree tree(in.size(), less);
+
+        int fd = single ? fds[0] : fds[t];
+        std::unique_ptr<char[]> buf(new char[SEGMENT_BUF]);
+        size_t pos = 0;
+        size_t at = single ? offset[t] : 0;
+        size_t records = 0;
+        auto flush = [&] {
+            scoped_timer timer(io_stats.ioNanos);
+            pwrite_all(fd, buf.get(), pos, at);
+            at += pos;
+            pos = 0;
+        };
+
+        for (;;) {
+            size_t i = tree.top();
+            cursor& c = in[i];
+            if (c.p == c.end)
+                break;
+
+            const char* nl = static_cast<const char*>(memchr(c.p, '\n', c.end - c.p));
+            size_t n = (nl ? nl + 1 : c.end) - c.p;
+            if (pos + n > SEGMENT_BUF)
+                flush();
+            if (n > SEGMENT_BUF) {
+                scoped_timer timer(io_stats.ioNanos);
+                pwrite_all(fd, c.p, n, at);
+                at += n;
+            } else {
+                memcpy(buf.get() + pos, c.p, n);
+                pos += n;
+            }
+            c.p += n;
+            records++;
+            tree.replay(i);
+        }
+        flush();
+
+        size_t bytes = offset[t + 1] - offset[t];
+        io_stats.bytesRead += bytes;
+        io_stats.bytesWritten += bytes;
+        io_stats.records += records;
+
+        merged_range& range = ranges[t];
+        if (t > 0)
+            range.from = splitters[t - 1];
+        if (t + 1 < parts)
+            range.to = splitters[t];
+        range.records = records;
+        range.bytes = bytes;
+    };
+
+    // more ranges than threads: each thread takes the next unmerged one
+    std::atomic<size_t> next{0};
+    auto worker = [&] {
+        for (size_t t; (t = next++) < parts;) {
+            merge_range(t);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < std::min(threads, parts); ++i) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& th : pool) {
+        th.join();
+    }
+
+    for (int fd : fds) {
+        close(fd);
+    }
+    return ranges;
+}
+
+// Merges sorted runs into `out`, a key range per thread.
+inline void parallel_merge(
+    const std::vector<std::string>& files,
+    const std::vector<run_span>& runs,
+    const std::string& out,
+    size_t threads
+) {
+    merge_ranges(files, runs, {out}, threads, threads);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "parallel_merge.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Output split into key ranges (--partitions=P): OUTPUT.0 ... OUTPUT.{P-1},
+// each sorted, every key of a file less than any key of the next one, and
+// OUTPUT.manifest with a line per file:
+//
+//   path \t from \t to \t records \t bytes
+//
+// A file holds the keys in [from, to); an empty bound is open. Equal keys never
+// straddle two files, so with heavy duplicates some files may be empty.
+
+inline std::vector<std::string> partition_paths(const std::string& output, size_t parts) {
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < parts; ++i) {
+        paths.push_back(output + "." + std::to_string(i));
+    }
+    return paths;
+}
+
+inline std::string manifest_path(const std::string& output) {
+    return output + ".manifest";
+}
+
+// Written last and renamed into place, so a manifest is only ever seen with
+// all of its files complete.
+inline void write_manifest(
+    const std::string& output,
+    const std::vector<std::string>& paths,
+    const std::vector<merged_range>& ranges
+) {
+    std::string path = manifest_path(output);
+    std::string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        perror("open");
+        exit(1);
+    }
+    for (size_t i = 0; i < paths.size(); ++i) {
+        const merged_range& r = ranges[i];
+        fprintf(f, "%s\t%s\t%s\t%zu\t%zu\n", paths[i].c_str(), r.from.c_str(), r.to.c_str(), r.records, r.bytes);
+    }
+    if (fclose(f) != 0 || rename(tmp.c_str(), path.c_str()) < 0) {
+        perror("write");
+        exit(1);
+    }
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "options.hh"
+#include "radix.hh"
+#include "shared.hh"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+#include <sys/stat.h>
+
+// How one --memory budget is spent. Buffer sizes go to io_config, everything
+// else is read by the sorters.
+struct plan {
+    bool in_memory = false; // the input fits: one sort, no temp files
+    size_t run_bytes = 0;   // record_batch bytes (or heap bytes) per initial run
+    size_t fan_in = 2;      // merge inputs
+};
+
+// Size of a regular input file, 0 for pipes and stdin.
+inline size_t input_size(const std::string& path) {
+    struct stat st;
+    if (path == "-" || stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+        return 0;
+    return st.st_size;
+}
+
+// Read and write buffers get 1/128 of the budget each (64K - 8M); the fan-in
+// follows from them, see fan_in_for(). Run generation takes half of what the
+// input buffer and the run files' output buffers leave (all fan-in files for
+// kway and polyphase, two otherwise): radix sorting a block needs two more
+// 16-byte words per record next to its 16-byte entry, roughly the size of a
+// short line. A file whose lines and index fit in the budget is sorted in one
+// go.
+inline plan make_plan(const options& opts, bool verbose = true) {
+    size_t buf = std::clamp(opts.memory / 128, (size_t)64 << 10, (size_t)8 << 20);
+    io.ibuf = io.obuf = buf;
+
+    plan p;
+    p.fan_in = fan_in_for(opts.memory);
+    size_t writers = 2;
+    if (opts.merge == merge_strategy::kway)
+        writers = p.fan_in;
+    else if (opts.merge == merge_strategy::polyphase)
+        writers = opts.tapes ? opts.tapes - 1 : p.fan_in;
+
+    size_t scale = io.async ? 2 : 1;
+    size_t buffers = (1 + writers) * buf * scale;
+    size_t rest = opts.memory > buffers ? opts.memory - buffers : 0;
+    p.run_bytes = std::clamp(rest / 2, (size_t)1 << 20, (size_t)1 << 31);
+
+    // assumes lines of at least 16 bytes: line + 3 * 16 bytes of index <= 4 * line
+    size_t size = input_size(opts.input);
+    p.in_memory = size && size <= p.run_bytes && size * 4 <= opts.memory;
+
+    if (!verbose)
+        return p;
+    std::cerr << "memory plan: ";
+    if (p.in_memory)
+        std::cerr << "in-memory sort\n";
+    else
+        std::cerr << "runs of " << (p.run_bytes >> 10) << "K, fan-in " << p.fan_in
+                  << ", " << (buf >> 10) << "K buffers\n";
+    return p;
+}
+
+// Sorts the records of `input` within `range` into `output` in memory; the
+// input is fully read before the output is opened, so the two may be the same
+// file.
+template <typename Writer = fast_writer>
+void sort_in_memory(const std::string& input, const std::string& output, const key_range& range = {}) {
+    record_batch all;
+    {
+        fast_reader in(input);
+        while (append_in_range(in, all, range)) {
+        }
+    }
+
+    Writer out(output);
+    out.write_batch(all, sorted_order(all));
+}
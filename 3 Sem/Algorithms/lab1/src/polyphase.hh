@@ -0,0 +1,223 @@
+#pragma once
+
+#include "loser_tree.hh"
+#include "shared.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Polyphase merge (Knuth, TAOCP 5.4.2, algorithm D).
+//
+// Runs are spread over T - 1 tapes following a generalized Fibonacci
+// distribution, padded with dummy runs up to the next perfect level. Each phase
+// merges T - 1 tapes into the empty one until one of the inputs runs dry; that
+// tape becomes the next output. There is no separate distribution pass.
+//
+// Run lengths are tracked in memory rather than by key order, so adjacent runs
+// on a tape that happen to be in order are never mistaken for one.
+// At most fan_in_for(memory) tapes are read while one is written.
+inline size_t tapes_for(size_t memory) {
+    return fan_in_for(memory) + 1;
+}
+
+class polyphase {
+    struct tape {
+        std::string path;
+        std::deque<size_t> runs; // length in records, 0 - dummy run
+        std::unique_ptr<fast_reader> in;
+        std::unique_ptr<fast_writer> out;
+    };
+
+    std::vector<tape> tapes;
+
+    // distribution state
+    std::vector<size_t> a; // perfect distribution of the current level
+    std::vector<size_t> d; // runs still missing on each tape for that level
+    size_t j = 0;
+    size_t len = 0;
+    size_t total = 0;
+
+public:
+    polyphase(const std::vector<std::string>& paths) : tapes(paths.size()) {
+        for (size_t i = 0; i < tapes.size(); ++i) {
+            tapes[i].path = paths[i];
+        }
+        // the last tape stays empty, it's the first output
+        for (size_t i = 0; i + 1 < tapes.size(); ++i) {
+            tapes[i].out = std::make_unique<fast_writer>(paths[i]);
+        }
+        a.assign(tapes.size(), 1);
+        d.assign(tapes.size(), 1);
+        a.back() = d.back() = 0;
+    }
+
+    template <typename Record>
+    void write_record(const Record& r) {
+        tapes[j].out->write_record(r);
+        len++;
+    }
+
+    template <typename Order>
+    void write_batch(const record_batch& b, const Order& order) {
+        tapes[j].out->write_batch(b, order);
+        len += b.size();
+    }
+
+    void next_run() {
+        if (!len)
+            return;
+        tapes[j].runs.push_back(len);
+        len = 0;
+        total++;
+        d[j]--;
+
+        if (d[j] < d[j + 1]) {
+            j++;
+            return;
+        }
+        j = 0;
+        if (d[j] != 0)
+            return;
+
+        // all tapes reached the current level, move to the next one
+        size_t p = tapes.size() - 1;
+        size_t a0 = a[0];
+        for (size_t i = 0; i < p; ++i) {
+            d[i] = a0 + a[i + 1] - a[i];
+            a[i] = a0 + a[i + 1];
+        }
+    }
+
+    // Merges everything distributed so far into `path`; the last phase writes
+    // there directly, so `path` may be "-". Closing the tapes ends the run
+    // generation pass in `metrics`. Returns the number of merge phases.
+    size_t merge_into(const std::string& path) {
+        next_run();
+
+        // dummy runs go first so the first phase consumes them
+        for (size_t i = 0; i + 1 < tapes.size(); ++i) {
+            tapes[i].runs.insert(tapes[i].runs.begin(), d[i], 0);
+            tapes[i].out.reset();
+        }
+        metrics.end("runs", 0, total);
+
+        if (total == 0) {
+            fast_writer empty(path);
+            return 0;
+        }
+        if (total == 1) {
+            move_file(tapes[0].path, path);
+            return 0;
+        }
+
+        size_t o = tapes.size() - 1;
+        for (size_t i = 0; i < tapes.size(); ++i) {
+            if (i != o)
+                tapes[i].in = std::make_unique<fast_reader>(tapes[i].path);
+        }
+        tapes[o].out = std::make_unique<fast_writer>(tapes[o].path);
+
+        size_t phases = 0;
+        while (true) {
+            phases++;
+
+            // a phase turns `merges` runs of every input into `merges` runs
+            size_t merges = phase_merges(o);
+            size_t runsIn = merges * (tapes.size() - 1);
+            metrics.begin();
+            if (entries() - merges * (tapes.size() - 2) == 1) {
+                tapes[o].out.reset();
+                {
+                    fast_writer w(path);
+                    merge_phase(o, w);
+                }
+                metrics.end("merge", runsIn, merges);
+                return phases;
+            }
+            merge_phase(o, *tapes[o].out);
+
+            // the output is read back from the start, the drained tape takes its place
+            size_t e = o;
+            for (size_t i = 0; i < tapes.size(); ++i) {
+                if (i != o && tapes[i].runs.empty()) {
+                    e = i;
+                    break;
+                }
+            }
+            tapes[o].out.reset();
+            metrics.end("merge", runsIn, merges);
+            tapes[o].in = std::make_unique<fast_reader>(tapes[o].path);
+            tapes[e].in.reset();
+            tapes[e].out = std::make_unique<fast_writer>(tapes[e].path);
+            o = e;
+        }
+    }
+
+private:
+    size_t entries() const {
+        size_t n = 0;
+        for (const auto& t : tapes) {
+            n += t.runs.size();
+        }
+        return n;
+    }
+
+    // Runs per input tape that the next phase merges: until one of them drains.
+    size_t phase_merges(size_t o) const {
+        size_t merges = SIZE_MAX;
+        for (size_t i = 0; i < tapes.size(); ++i) {
+            if (i != o)
+                merges = std::min(merges, tapes[i].runs.size());
+        }
+        return merges;
+    }
+
+    void merge_phase(size_t o, fast_writer& w) {
+        std::vector<size_t> inputs;
+        for (size_t i = 0; i < tapes.size(); ++i) {
+            if (i != o)
+                inputs.push_back(i);
+        }
+        size_t merges = phase_merges(o);
+
+        std::vector<record> cur(inputs.size());
+        std::vector<size_t> left(inputs.size());
+        auto less = [&](size_t x, size_t y) {
+            if (!left[x])
+                return false;
+            if (!left[y])
+                return true;
+            return cur[x] < cur[y];
+        };
+        loser_tree tree(inputs.size(), less);
+
+        for (size_t m = 0; m < merges; ++m) {
+            size_t sum = 0;
+            for (size_t x = 0; x < inputs.size(); ++x) {
+                tape& t = tapes[inputs[x]];
+                left[x] = t.runs.front();
+                t.runs.pop_front();
+                sum += left[x];
+                if (left[x])
+                    t.in->next_record(cur[x]);
+            }
+            tapes[o].runs.push_back(sum);
+
+            tree.rebuild();
+            for (;;) {
+                size_t x = tree.top();
+                if (!left[x])
+                    break;
+                w.write_record(cur[x]);
+                if (--left[x])
+                    tapes[inputs[x]].in->next_record(cur[x]);
+                tree.replay(x);
+            }
+        }
+    }
+};
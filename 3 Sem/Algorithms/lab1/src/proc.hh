@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+// Directory of the running executable, where the other lab binaries live.
+inline std::string self_dir() {
+    char buf[4096];
+    ssize_t n = readlink("/proc/self/exe", buf, sizeof buf - 1);
+    if (n <= 0)
+        return ".";
+    std::string path(buf, n);
+    return path.substr(0, path.rfind('/'));
+}
+
+// Replaces the process with `args[0]`; returns only to report a failure.
+[[noreturn]] inline void exec(const std::vector<std::string>& args) {
+    std::vector<char*> argv;
+    for (const auto& a : args) {
+        argv.push_back(const_cast<char*>(a.c_str()));
+    }
+    argv.push_back(nullptr);
+    execv(argv[0], argv.data());
+    perror("exec");
+    _exit(127);
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+struct key_index {
+    uint64_t key; // pack_key() of the record's key
+    uint32_t index;
+};
+
+// Stable LSD radix sort of (packed key, index) pairs, one byte per pass. Bytes
+// that are equal in every key are skipped, which for our 5-byte keys leaves 5
+// passes and never touches the records themselves.
+//
+// Packed keys only order keys up to 7 bytes; ranges of equal packed keys longer
+// than that are finished with `full_less` on the original records. `tmp` is
+// scratch of v's size; passing the same vector again saves its allocation.
+template <typename FullLess>
+void radix_sort(std::vector<key_index>& v, FullLess full_less, std::vector<key_index>& tmp) {
+    size_t n = v.size();
+    std::vector<size_t> count(8 * 256, 0);
+    for (const auto& e : v) {
+        for (size_t b = 0; b < 8; ++b) {
+            count[b * 256 + ((e.key >> (8 * b)) & 0xff)]++;
+        }
+    }
+
+    tmp.resize(n);
+    for (size_t b = 0; b < 8; ++b) {
+        size_t* c = &count[b * 256];
+        if (n == 0 || c[(v[0].key >> (8 * b)) & 0xff] == n)
+            continue;
+
+        size_t sum = 0;
+        for (size_t i = 0; i < 256; ++i) {
+            size_t k = c[i];
+            c[i] = sum;
+            sum += k;
+        }
+        for (const auto& e : v) {
+            tmp[c[(e.key >> (8 * b)) & 0xff]++] = e;
+        }
+        v.swap(tmp);
+    }
+
+    for (size_t i = 0; i < n;) {
+        size_t j = i + 1;
+        while (j < n && v[j].key == v[i].key) {
+            ++j;
+        }
+        if (j - i > 1 && (v[i].key & 0xff) == 8)
+            std::stable_sort(v.begin() + i, v.begin() + j, full_less);
+        i = j;
+    }
+}
+
+template <typename FullLess>
+void radix_sort(std::vector<key_index>& v, FullLess full_less) {
+    std::vector<key_index> tmp;
+    radix_sort(v, full_less, tmp);
+}
+
+// Stable sort order of records by key into `order`, reusing its and tmp's
+// capacity; the records themselves are not moved.
+template <typename Records>
+void sorted_order(const Records& records, std::vector<key_index>& order, std::vector<key_index>& tmp) {
+    order.resize(records.size());
+    for (size_t i = 0; i < records.size(); ++i) {
+        order[i] = {records[i].packed, (uint32_t)i};
+    }
+    radix_sort(
+        order,
+        [&](const key_index& a, const key_index& b) {
+            return records[a.index].key < records[b.index].key;
+        },
+        tmp
+    );
+}
+
+template <typename Records>
+std::vector<key_index> sorted_order(const Records& records) {
+    std::vector<key_index> order, tmp;
+    sorted_order(records, order, tmp);
+    return order;
+}
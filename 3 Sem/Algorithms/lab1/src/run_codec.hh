@@ -0,0 +1,214 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Compact format for temp run files. Text lines ("KEY\tDATA\n", KEY_SIZE-byte
+// keys, as fast_writer lays them out) are packed into blocks:
+//
+//   u32 raw size | u32 lines | u32 body size | body
+//
+//   body: per line   u8 shared prefix with the previous key << 4 | suffix size,
+//                    suffix bytes
+//         per line   varint payload size
+//         rest       payloads, concatenated and LZ-compressed
+//
+// Sorted runs have long common key prefixes and the tab/newline framing is
+// implied, so blocks come out well below the text even when payloads don't
+// compress.
+
+inline void put_varint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out += (char)(v | 0x80);
+        v >>= 7;
+    }
+    out += (char)v;
+}
+
+inline uint64_t get_varint(const char*& p) {
+    uint64_t v = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+}
+
+inline uint32_t load32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+inline void put32(std::string& out, uint32_t v) {
+    out.append(reinterpret_cast<const char*>(&v), 4);
+}
+
+// LZ77 in the spirit of LZ4: a 4K-entry hash of 4-byte sequences finds matches
+// up to 64K back. Output is a sequence of
+//   varint literal count, literals, [varint match length - 4, u16 offset]
+// where the last sequence has no match.
+inline void lz_compress(const char* in, size_t n, std::string& out) {
+    static const size_t HASH_BITS = 12;
+    std::vector<uint32_t> table(1 << HASH_BITS, UINT32_MAX);
+
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + 4 <= n) {
+        uint32_t seq = load32(in + i);
+        uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+        size_t cand = table[h];
+        table[h] = i;
+
+        if (cand == UINT32_MAX || i - cand > 0xffff || load32(in + cand) != seq) {
+            i++;
+            continue;
+        }
+
+        size_t len = 4;
+        while (i + len < n && in[cand + len] == in[i + len]) {
+            len++;
+        }
+
+        put_varint(out, i - anchor);
+        out.append(in + anchor, i - anchor);
+        put_varint(out, len - 4);
+        uint16_t off = i - cand;
+        out.append(reinterpret_cast<const char*>(&off), 2);
+
+        i += len;
+        anchor = i;
+    }
+
+    put_varint(out, n - anchor);
+    out.append(in + anchor, n - anchor);
+}
+
+// Inflates exactly `n` bytes into `out`.
+inline void lz_decompress(const char* p, size_t n, char* out) {
+    size_t o = 0;
+    while (true) {
+        size_t lit = get_varint(p);
+        memcpy(out + o, p, lit);
+        p += lit;
+        o += lit;
+        if (o >= n)
+            return;
+
+        size_t len = get_varint(p) + 4;
+        uint16_t off;
+        memcpy(&off, p, 2);
+        p += 2;
+        // byte by byte: the match may overlap what it's copying
+        for (size_t k = 0; k < len; ++k, ++o) {
+            out[o] = out[o - off];
+        }
+    }
+}
+
+// Turns a stream of text into blocks. Lines may be split across encode()
+// calls; the unfinished tail waits for the next one.
+class run_encoder {
+    size_t keySize;
+    std::string carry;
+    std::string keys, sizes, payload, body;
+
+public:
+    explicit run_encoder(size_t keySize) : keySize(keySize) {}
+
+    // Appends a block with every complete line of carry + [p, p + n) to `out`.
+    void encode(const char* p, size_t n, std::string& out) {
+        std::string_view text(p, n);
+        if (!carry.empty()) {
+            carry.append(p, n);
+            text = carry;
+        }
+
+        size_t end = text.rfind('\n');
+        if (end == std::string_view::npos) {
+            if (carry.empty())
+                carry.assign(p, n);
+            return;
+        }
+        end++;
+
+        keys.clear();
+        sizes.clear();
+        payload.clear();
+        std::string_view prev;
+        uint32_t lines = 0;
+        for (size_t at = 0; at < end; lines++) {
+            size_t nl = text.find('\n', at);
+            std::string_view key = text.substr(at, keySize);
+            std::string_view data = text.substr(at + keySize + 1, nl - at - keySize - 1);
+
+            size_t shared = 0;
+            while (shared < prev.size() && key[shared] == prev[shared]) {
+                shared++;
+            }
+            keys += (char)(shared << 4 | (key.size() - shared));
+            keys.append(key.substr(shared));
+            put_varint(sizes, data.size());
+            payload.append(data);
+
+            prev = key;
+            at = nl + 1;
+        }
+
+        body.clear();
+        body += keys;
+        body += sizes;
+        lz_compress(payload.data(), payload.size(), body);
+
+        put32(out, end);
+        put32(out, lines);
+        put32(out, body.size());
+        out += body;
+
+        std::string rest(text.substr(end));
+        carry.swap(rest);
+    }
+};
+
+// Rebuilds the text of one block. `payload` is scratch space.
+inline void run_decode(
+    const char* body, uint32_t lines, char* out, std::vector<char>& payload, size_t keySize
+) {
+    const char* p = body;
+    const char* keys = p;
+    for (uint32_t i = 0; i < lines; ++i) {
+        p += 1 + ((uint8_t)*p & 0xf);
+    }
+
+    std::vector<uint64_t> sizes(lines);
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < lines; ++i) {
+        sizes[i] = get_varint(p);
+        total += sizes[i];
+    }
+    payload.resize(total);
+    lz_decompress(p, total, payload.data());
+
+    const char* data = payload.data();
+    char* prev = nullptr;
+    for (uint32_t i = 0; i < lines; ++i) {
+        size_t shared = (uint8_t)*keys >> 4;
+        size_t suffix = (uint8_t)*keys & 0xf;
+        keys++;
+        if (shared)
+            memcpy(out, prev, shared);
+        memcpy(out + shared, keys, suffix);
+        keys += suffix;
+        prev = out;
+
+        out[keySize] = '\t';
+        memcpy(out + keySize + 1, data, sizes[i]);
+        data += sizes[i];
+        out += keySize + 1 + sizes[i];
+        *out++ = '\n';
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+    #include <immintrin.h>
+#endif
+
+// Bitmask of the bytes equal to `c` among the 64 bytes at `p` (bit i - p[i]).
+inline uint64_t match64(const char* p, char c) {
+#if defined(__AVX2__)
+    __m256i n = _mm256_set1_epi8(c);
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+    uint32_t lo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, n));
+    uint32_t hi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, n));
+    return lo | (uint64_t)hi << 32;
+#elif defined(__SSE2__)
+    __m128i n = _mm_set1_epi8(c);
+    uint64_t m = 0;
+    for (int i = 0; i < 4; ++i) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i));
+        m |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, n)) << (16 * i);
+    }
+    return m;
+#else
+    uint64_t m = 0;
+    for (int i = 0; i < 64; ++i) {
+        m |= (uint64_t)(p[i] == c) << i;
+    }
+    return m;
+#endif
+}
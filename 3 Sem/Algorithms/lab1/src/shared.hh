@@ -1,94 +1,554 @@
 #pragma once
 
+#include "async_io.hh"
+#include "packed_key.hh"
+#include "run_codec.hh"
+#include "scan.hh"
+#include "sparse_index.hh"
+#include "stats.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-static const size_t IBUF_SIZE = 1 << 20;
-static const size_t OBUF_SIZE = 1 << 20;
+static const size_t MAX_FAN_IN = 256;
+static const size_t KEY_SIZE = 5;
+static const size_t BATCH_BYTES = 64 << 10;
+
+// Inclusive bounds on keys, e.g. --from=AAAAA --to=CZZZZ; an empty bound is open.
+struct key_range {
+    std::string from, to;
+
+    bool all() const {
+        return from.empty() && to.empty();
+    }
+
+    bool contains(std::string_view key) const {
+        return (from.empty() || key >= from) && (to.empty() || key <= to);
+    }
+};
 
 struct record {
     std::string key;
     std::string data;
+    uint64_t packed = 0; // pack_key(key), filled in by the readers
 
     bool operator<=(const record& other) const {
-        return key <= other.key;
+        return !(other < *this);
     }
 
     bool operator<(const record& other) const {
-        return key < other.key;
+        return key_less(packed, key, other.packed, other.key);
     }
 
     bool operator>=(const record& other) const {
-        return key >= other.key;
+        return !(*this < other);
     }
 };
 
+// Non-owning record, e.g. pointing into a memory-mapped file.
+struct record_view {
+    std::string_view key;
+    std::string_view data;
+    uint64_t packed = 0;
+
+    bool operator<=(const record_view& other) const {
+        return !(other < *this);
+    }
+
+    bool operator<(const record_view& other) const {
+        return key_less(packed, key, other.packed, other.key);
+    }
+
+    bool operator>=(const record_view& other) const {
+        return !(*this < other);
+    }
+};
+
+// Records stored back to back as "KEY\tDATA\n" lines, either in an owned byte
+// arena or, for mapped files, in memory owned by the reader. Each entry is the
+// offset, length and packed key of one line, so a block costs two allocations
+// no matter how many records it holds, and both are reused after clear().
+// Offsets are 32-bit: a batch holds at most 4 GiB of lines.
+struct record_batch {
+    struct entry {
+        uint64_t packed;
+        uint32_t offset; // from data()
+        uint32_t size;   // line length without '\n'
+    };
+
+    std::vector<char> arena;
+    std::vector<entry> entries;
+    const char* external = nullptr; // lines live outside the arena
+
+    void clear() {
+        arena.clear();
+        entries.clear();
+        external = nullptr;
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    bool empty() const {
+        return entries.empty();
+    }
+
+    // Memory held by the records: lines plus entries.
+    size_t bytes() const {
+        size_t lines = entries.empty() ? 0 : entries.back().offset + entries.back().size + 1;
+        return lines + entries.size() * sizeof(entry);
+    }
+
+    const char* data() const {
+        return external ? external : arena.data();
+    }
+
+    std::string_view key(size_t i) const {
+        return std::string_view(data() + entries[i].offset, KEY_SIZE);
+    }
+
+    record_view operator[](size_t i) const {
+        const entry& e = entries[i];
+        const char* p = data() + e.offset;
+        return {
+            std::string_view(p, KEY_SIZE),
+            std::string_view(p + KEY_SIZE + 1, e.size - KEY_SIZE - 1),
+            e.packed,
+        };
+    }
+
+    bool less(size_t a, size_t b) const {
+        return key_less(entries[a].packed, key(a), entries[b].packed, key(b));
+    }
+
+    // Whether entry i is smaller than the record before it. `before` holds the
+    // key preceding entry 0, e.g. the last one of the previous batch.
+    bool descends(size_t i, const record& before) const {
+        if (i > 0)
+            return less(i, i - 1);
+        return key_less(entries[0].packed, key(0), before.packed, before.key);
+    }
+
+    void last_key(record& out) const {
+        out.key.assign(key(size() - 1));
+        out.packed = entries.back().packed;
+    }
+
+    template <typename Record>
+    void push_back(const Record& r) {
+        size_t start = arena.size();
+        for (size_t i = 0; i < KEY_SIZE; ++i) {
+            arena.push_back((i < r.key.size()) ? r.key[i] : ' ');
+        }
+        arena.push_back('\t');
+        arena.insert(arena.end(), r.data.begin(), r.data.end());
+        size_t size = arena.size() - start;
+        arena.push_back('\n');
+        entries.push_back({pack_key(key_at(start)), (uint32_t)start, (uint32_t)size});
+    }
+
+    // Drops the entries from index `from` on whose keys are outside `range`.
+    // Arena lines are compacted, so the batch stays back to back and its bytes()
+    // only count what's kept.
+    void filter(size_t from, const key_range& range) {
+        if (range.all() || from >= entries.size())
+            return;
+        size_t out = from;
+        size_t pos = entries[from].offset; // arena write position
+        for (size_t i = from; i < entries.size(); ++i) {
+            entry e = entries[i];
+            if (!range.contains(key(i)))
+                continue;
+            if (!external) {
+                memmove(arena.data() + pos, arena.data() + e.offset, e.size + 1);
+                e.offset = pos;
+                pos += e.size + 1;
+            }
+            entries[out++] = e;
+        }
+        entries.resize(out);
+        if (!external)
+            arena.resize(pos);
+    }
+
+    // Line `i` without its newline.
+    std::string_view line(size_t i) const {
+        return std::string_view(data() + entries[i].offset, entries[i].size);
+    }
+
+    // Lines [from, to) as one span, without the last newline (a mapped file may
+    // not have one).
+    std::string_view lines(size_t from, size_t to) const {
+        const entry& last = entries[to - 1];
+        return std::string_view(data() + entries[from].offset, last.offset + last.size - entries[from].offset);
+    }
+
+    std::string_view key_at(size_t offset) const {
+        return std::string_view(data() + offset, KEY_SIZE);
+    }
+
+    // Adds an entry for every line in [from, to) of data(), which must end with
+    // '\n'. Newlines are found 64 bytes at a time; only the key/tab layout of each
+    // line is checked, since keys are fixed-width. Stops at the first malformed
+    // line and returns its offset (`to` if all lines were good).
+    size_t index_lines(size_t from, size_t to) {
+        const char* base = data();
+        size_t line = from;
+        auto add = [&](size_t nl) {
+            size_t size = nl - line;
+            if (size <= KEY_SIZE || base[line + KEY_SIZE] != '\t')
+                return false;
+            entries.push_back({pack_key(key_at(line)), (uint32_t)line, (uint32_t)size});
+            line = nl + 1;
+            return true;
+        };
+
+        size_t i = from;
+        for (; i + 64 <= to; i += 64) {
+            for (uint64_t m = match64(base + i, '\n'); m; m &= m - 1) {
+                if (!add(i + __builtin_ctzll(m)))
+                    return line;
+            }
+        }
+        while (i < to) {
+            const char* nl = static_cast<const char*>(memchr(base + i, '\n', to - i));
+            if (!nl)
+                break;
+            if (!add(nl - base))
+                return line;
+            i = nl - base + 1;
+        }
+        return line;
+    }
+};
+
+// Whether `path` is a temp run kept in the packed format.
+inline bool packed_path(const std::string& path) {
+    return io.compress && path.size() > 4 && path.compare(path.size() - 4, 4, ".run") == 0;
+}
+
+// Buffered writer straight on top of the fd. Records are laid out with memcpy
+// of whole spans; anything too large for the buffer goes out together with the
+// buffered bytes in a single writev(). Packed files get one block per flush.
 struct fast_writer {
-    FILE* f;
-    char buf[OBUF_SIZE];
+    int fd;
+    size_t cap = io.obuf;
+    std::unique_ptr<char[]> buf;
     size_t pos = 0;
+    size_t flushed = 0;
+    size_t pending = 0; // records not yet published to io_stats
+    std::unique_ptr<drainer> async;
+    std::unique_ptr<run_encoder> packer;
+    std::string block; // encoded bytes of the current flush
+    std::unique_ptr<index_builder> index;
 
-    fast_writer(const std::string& path) {
-        f = fopen(path.c_str(), "wb");
-        if (!f) {
+    // "-" writes to stdout.
+    fast_writer(const std::string& path) : buf(new char[cap]), index(index_for(path, KEY_SIZE)) {
+        fd = path == "-" ? STDOUT_FILENO : open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
             perror("open");
             exit(1);
         }
+        if (packed_path(path))
+            packer = std::make_unique<run_encoder>(KEY_SIZE);
+        else if (io.async)
+            async = std::make_unique<drainer>(fd, cap);
     }
 
+    fast_writer(const fast_writer&) = delete;
+    fast_writer& operator=(const fast_writer&) = delete;
+
     ~fast_writer() {
         flush();
-        fclose(f);
+        async.reset();
+        if (index) {
+            index->write(offset());
+            indexed.fresh = true;
+        }
+        if (fd != STDOUT_FILENO)
+            close(fd);
     }
 
     inline void flush() {
-        if (pos) {
-            fwrite(buf, 1, pos, f);
+        if (pos && packer) {
+            block.clear();
+            packer->encode(buf.get(), pos, block);
+            write_block();
+            flushed += pos;
+            pos = 0;
+        } else if (pos) {
+            scoped_timer t(io_stats.ioNanos);
+            if (async)
+                async->swap(buf, pos);
+            else
+                write_all(fd, buf.get(), pos);
+            io_stats.bytesWritten += pos;
+            flushed += pos;
             pos = 0;
         }
+        io_stats.records += pending;
+        pending = 0;
+    }
+
+    // Bytes written so far, including the buffered ones.
+    size_t offset() const {
+        return flushed + pos;
+    }
+
+    template <typename Record>
+    inline void write_record(const Record& r) {
+        if (index)
+            index->add(r.key, offset());
+        pending++;
+        size_t n = KEY_SIZE + 1 + r.data.size() + 1;
+        if (n > cap - pos) {
+            if (r.data.size() >= cap / 2) {
+                put_key(r.key);
+                write_through(r.data);
+                return;
+            }
+            flush();
+        }
+
+        put_key(r.key);
+        memcpy(buf.get() + pos, r.data.data(), r.data.size());
+        pos += r.data.size();
+        buf[pos++] = '\n';
     }
 
-    inline void write_record(const record& r) {
-        if (pos > OBUF_SIZE - (6 + 1 + r.data.size() + 1))
+    // Writes `line` ("KEY\tDATA", as stored in a record_batch) and a newline.
+    inline void write_line(std::string_view line) {
+        if (index)
+            index->add(line.substr(0, KEY_SIZE), offset());
+        pending++;
+        if (line.size() + 1 > cap - pos) {
+            if (line.size() >= cap / 2) {
+                write_through(line);
+                return;
+            }
             flush();
+        }
+
+        memcpy(buf.get() + pos, line.data(), line.size());
+        pos += line.size();
+        buf[pos++] = '\n';
+    }
+
+    // Writes the records of `b` in the given order (a range of key_index).
+    template <typename Order>
+    void write_batch(const record_batch& b, const Order& order) {
+        for (const auto& e : order) {
+            write_line(b.line(e.index));
+        }
+    }
 
-        for (size_t i = 0; i < 5; ++i) {
-            buf[pos++] = (i < r.key.size()) ? r.key[i] : ' ';
+    // Writes records [from, to) of `b`. They sit back to back in the batch, so
+    // this is a single copy.
+    void write_lines(const record_batch& b, size_t from, size_t to) {
+        if (from == to)
+            return;
+        for (size_t i = from; index && i < to; ++i) {
+            index->add(b.key(i), offset() + b.entries[i].offset - b.entries[from].offset);
         }
+        pending += to - from - 1;
+        write_line(b.lines(from, to));
+    }
+
+private:
+    // The key padded or cut to KEY_SIZE, and the tab; makes room if needed.
+    void put_key(std::string_view key) {
+        if (KEY_SIZE + 1 > cap - pos)
+            flush();
+        size_t k = std::min(key.size(), KEY_SIZE);
+        memcpy(buf.get() + pos, key.data(), k);
+        memset(buf.get() + pos + k, ' ', KEY_SIZE - k);
+        pos += KEY_SIZE;
         buf[pos++] = '\t';
+    }
+
+    void write_block() {
+        scoped_timer t(io_stats.ioNanos);
+        write_all(fd, block.data(), block.size());
+        io_stats.bytesWritten += block.size();
+    }
 
-        for (char c : r.data) {
-            buf[pos++] = c;
+    // Sends the buffer, `tail` and a newline in one writev(), bypassing the copy.
+    void write_through(std::string_view tail) {
+        if (packer) {
+            block.clear();
+            packer->encode(buf.get(), pos, block);
+            packer->encode(tail.data(), tail.size(), block);
+            packer->encode("\n", 1, block);
+            write_block();
+            flushed += pos + tail.size() + 1;
+            pos = 0;
+            return;
         }
-        buf[pos++] = '\n';
+
+        scoped_timer t(io_stats.ioNanos);
+        if (async) {
+            flush();
+            async->wait();
+        }
+        iovec iov[3] = {
+            {buf.get(), pos},
+            {const_cast<char*>(tail.data()), tail.size()},
+            {const_cast<char*>("\n"), 1},
+        };
+        write_all(fd, iov, 3);
+        io_stats.bytesWritten += pos + tail.size() + 1;
+        flushed += pos + tail.size() + 1;
+        pos = 0;
+    }
+};
+
+// Byte range of one sorted run inside a set of run files.
+struct run_span {
+    size_t file;
+    size_t begin;
+    size_t end;
+};
+
+// Writes consecutive runs round-robin over a set of files. With `keepSpans`
+// it also remembers where each run went, for finish(); natural runs of random
+// input come by the million, so only callers that need them pay for that.
+template <typename Writer = fast_writer>
+class run_writers {
+    std::vector<std::unique_ptr<Writer>> out;
+    size_t cur = 0;
+    size_t begin = 0;
+    bool keepSpans;
+    std::vector<run_span> spans;
+public:
+    run_writers(const std::vector<std::string>& paths, bool keepSpans = false) : keepSpans(keepSpans) {
+        for (const auto& p : paths) {
+            out.push_back(std::make_unique<Writer>(p));
+        }
+    }
+
+    template <typename Record>
+    void write_record(const Record& r) {
+        out[cur]->write_record(r);
+    }
+
+    template <typename Order>
+    void write_batch(const record_batch& b, const Order& order) {
+        out[cur]->write_batch(b, order);
+    }
+
+    void write_lines(const record_batch& b, size_t from, size_t to) {
+        out[cur]->write_lines(b, from, to);
+    }
+
+    void next_run() {
+        size_t end = out[cur]->offset();
+        if (keepSpans && end > begin)
+            spans.push_back({cur, begin, end});
+        cur = (cur + 1) % out.size();
+        begin = out[cur]->offset();
+    }
+
+    // Closes the current run and returns where every run ended up (needs keepSpans).
+    const std::vector<run_span>& finish() {
+        next_run();
+        return spans;
     }
 };
 
 struct fast_reader {
+    using record_type = record;
+
     FILE* f;
-    char buf[IBUF_SIZE];
+    size_t cap = io.ibuf;
+    std::unique_ptr<char[]> buf;
     size_t len = 0, pos = 0;
+    std::unique_ptr<prefetcher> async;
+    bool stopped = false; // next_record() failed, next_batch() won't continue
+    uint64_t waited = 0;  // nanoseconds spent in refill()
+    bool packed;
+    std::vector<char> block, payload; // packed: encoded block, decoder scratch
 
-    fast_reader(const std::string& path) {
-        f = fopen(path.c_str(), "rb");
+    // "-" reads stdin.
+    fast_reader(const std::string& path) : buf(new char[cap]), packed(packed_path(path)) {
+        f = path == "-" ? stdin : fopen(path.c_str(), "rb");
         if (!f) {
             perror("open");
             exit(1);
         }
+        if (io.async && !packed)
+            async = std::make_unique<prefetcher>(f, cap);
     }
 
     ~fast_reader() {
-        fclose(f);
+        async.reset();
+        if (f != stdin)
+            fclose(f);
     }
 
-    inline int read() {
-        if (pos >= len) {
-            len = fread(buf, 1, IBUF_SIZE, f);
-            pos = 0;
-            if (!len)
-                return EOF;
+    bool refill() {
+        if (packed)
+            return unpack();
+
+        uint64_t start = now_nanos();
+        len = async ? async->swap(buf) : fread(buf.get(), 1, cap, f);
+        pos = 0;
+
+        uint64_t t = now_nanos() - start;
+        waited += t;
+        io_stats.ioNanos += t;
+        io_stats.bytesRead += len;
+        return len != 0;
+    }
+
+    // Reads the next block of a packed file and decodes it into the buffer.
+    bool unpack() {
+        uint64_t start = now_nanos();
+        char header[12];
+        size_t n = fread(header, 1, sizeof header, f);
+        if (n == sizeof header) {
+            block.resize(load32(header + 8));
+            n += fread(block.data(), 1, block.size(), f);
+        }
+        pos = len = 0;
+
+        uint64_t t = now_nanos() - start;
+        waited += t;
+        io_stats.ioNanos += t;
+        io_stats.bytesRead += n;
+        if (n == 0)
+            return false;
+        if (n < sizeof header || n != sizeof header + block.size()) {
+            fputs("truncated run file\n", stderr);
+            exit(1);
         }
-        return buf[pos++];
+
+        size_t raw = load32(header);
+        if (raw > cap) {
+            cap = raw;
+            buf.reset(new char[cap]);
+        }
+        run_decode(block.data(), load32(header + 4), buf.get(), payload, KEY_SIZE);
+        len = raw;
+        return true;
+    }
+
+    inline int read() {
+        if (pos >= len && !refill())
+            return EOF;
+        return (unsigned char)buf[pos++];
     }
 
     bool next_record(record& out) {
@@ -96,7 +556,7 @@ struct fast_reader {
         out.data.clear();
         int c;
 
-        for (int i = 0; i < 5; ++i) {
+        for (size_t i = 0; i < KEY_SIZE; ++i) {
             c = read();
             if (c == EOF || c == '\n')
                 return false;
@@ -106,6 +566,7 @@ struct fast_reader {
         c = read();
         if (c != '\t')
             return false;
+        out.packed = pack_key(out.key);
 
         while ((c = read()) != '\n' && c != EOF) {
             out.data += (char)c;
@@ -113,29 +574,119 @@ struct fast_reader {
 
         return true;
     }
+
+    // Appends the next record to the batch arena without an intermediate record.
+    bool next_record(record_batch& b) {
+        std::vector<char>& a = b.arena;
+        size_t start = a.size();
+        int c;
+
+        for (size_t i = 0; i < KEY_SIZE; ++i) {
+            c = read();
+            if (c == EOF || c == '\n') {
+                a.resize(start);
+                return false;
+            }
+            a.push_back((char)c);
+        }
+
+        c = read();
+        if (c != '\t') {
+            a.resize(start);
+            return false;
+        }
+        a.push_back('\t');
+
+        while ((c = read()) != '\n' && c != EOF) {
+            a.push_back((char)c);
+        }
+        size_t size = a.size() - start;
+        a.push_back('\n');
+
+        b.entries.push_back({pack_key(b.key_at(start)), (uint32_t)start, (uint32_t)size});
+        return true;
+    }
+
+    // Appends about `max_bytes` of records to `b`. All complete lines in the
+    // buffer are copied into the arena at once and tokenized there; only a line
+    // that crosses the end of the buffer goes through next_record().
+    bool append_batch(record_batch& b, size_t max_bytes = BATCH_BYTES) {
+        uint64_t start = now_nanos(), waited0 = waited;
+        size_t before = b.size();
+        size_t target = b.bytes() + max_bytes;
+
+        while (!stopped && b.bytes() < target) {
+            if (pos >= len && !refill()) {
+                stopped = true;
+                break;
+            }
+
+            const char* p = buf.get() + pos;
+            size_t avail = std::min(len - pos, target - b.bytes());
+            const char* nl = static_cast<const char*>(memrchr(p, '\n', avail));
+            if (!nl) {
+                stopped = !next_record(b);
+                continue;
+            }
+
+            size_t n = nl + 1 - p;
+            size_t start = b.arena.size();
+            b.arena.insert(b.arena.end(), p, p + n);
+            size_t good = b.index_lines(start, start + n);
+            pos += good - start;
+            if (good != start + n) {
+                // let the byte-wise parser reject the malformed line
+                b.arena.resize(good);
+                stopped = !next_record(b);
+            }
+        }
+
+        io_stats.parseNanos += now_nanos() - start - (waited - waited0);
+        return b.size() > before;
+    }
+
+    bool next_batch(record_batch& b, size_t max_bytes = BATCH_BYTES) {
+        b.clear();
+        return append_batch(b, max_bytes);
+    }
 };
 
-class run_reader {
-    fast_reader fr;
-    record prev;
-    record cur;
-    bool hasCur;
-    bool boundary; // cur -> next run relative to prev. run
+// Walks a file batch by batch and reports where one sorted run ends and the
+// next begins.
+template <typename Reader>
+class basic_run_reader {
+    Reader fr;
+    record_batch batch;
+    size_t i = 0;
+    bool boundary = false; // cur -> next run relative to prev. run
+    record prev;           // last key of the previous batch
+    size_t scan = 0;       // see run_end()
+
+    // First index after i where the batch starts another run, or its size.
+    // Every position is compared once per batch however often this is asked.
+    size_t run_end() {
+        scan = std::max(scan, i + 1);
+        while (scan < batch.size() && !batch.less(scan, scan - 1)) {
+            scan++;
+        }
+        return scan;
+    }
+
 public:
-    run_reader(const std::string& path) : fr(path), hasCur(false), boundary(false) {
-        read_first();
+    basic_run_reader(const std::string& path) : fr(path) {
+        fr.next_batch(batch);
     }
 
     bool has_value() const {
-        return hasCur;
+        return i < batch.size();
     }
 
     bool at_boundary() const {
         return boundary;
     }
 
-    const record& peek() const {
-        return cur;
+    record_view peek() const {
+        return batch[i];
     }
 
     void clear_boundary() {
@@ -143,27 +694,240 @@ public:
     }
 
     void consume() {
-        if (!hasCur || boundary)
+        if (!has_value() || boundary)
             return; // should not consume past boundary
-        prev = cur;
-        record x;
-        if (fr.next_record(x)) {
-            boundary = (x < prev);
-            cur = x;
-            hasCur = true;
-        } else {
-            hasCur = false;
+
+        if (++i == batch.size()) {
+            batch.last_key(prev);
+            fr.next_batch(batch);
+            i = scan = 0;
         }
+        if (has_value())
+            boundary = batch.descends(i, prev);
     }
 
-private:
-    void read_first() {
-        record x;
-        if (fr.next_record(x)) {
-            cur = x;
-            hasCur = true;
-            boundary = false;
-            prev = x;
+    // Consumes the records of the current run that sort before `bound` (or
+    // equal to it, if `ties`; all of them if there is no bound) and writes them
+    // to `w` in one piece. The cut is found by exponential search from the
+    // head, so a stretch of n records costs O(log n) comparisons. Stops at the
+    // end of the batch; returns the number of records taken.
+    template <typename Writer>
+    size_t gallop(const record_view* bound, bool ties, Writer& w) {
+        auto before = [&](size_t k) {
+            return ties ? batch[k] <= *bound : batch[k] < *bound;
+        };
+        if (!has_value() || boundary || (bound && !before(i)))
+            return 0;
+
+        size_t end = run_end();
+        size_t k = end;
+        if (bound) {
+            // before(i + last) holds, i + ofs is past the cut or the end
+            size_t last = 0, ofs = 1;
+            while (i + ofs < end && before(i + ofs)) {
+                last = ofs;
+                ofs = ofs * 2 + 1;
+            }
+            size_t lo = i + last + 1, hi = std::min(i + ofs, end);
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (before(mid))
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            k = lo;
         }
+
+        size_t taken = k - i;
+        w.write_lines(batch, i, k);
+        i = k - 1;
+        consume();
+        return taken;
     }
 };
+
+using run_reader = basic_run_reader<fast_reader>;
+
+// append_batch() that drops the new records outside `range`. Returns false at
+// the end of the input only, the batch may not have grown.
+template <typename Reader>
+bool append_in_range(Reader& in, record_batch& b, const key_range& range, size_t max_bytes = BATCH_BYTES) {
+    size_t before = b.size();
+    if (!in.append_batch(b, max_bytes))
+        return false;
+    b.filter(before, range);
+    return true;
+}
+
+// next_record() that skips records outside `range`.
+template <typename Reader>
+bool next_in_range(Reader& in, typename Reader::record_type& r, const key_range& range) {
+    while (in.next_record(r)) {
+        if (range.contains(r.key))
+            return true;
+    }
+    return false;
+}
+
+static const size_t MIN_GALLOP = 7;
+
+// Merges the current runs of `r1` and `r2` into `w`, r1 first on equal keys.
+// As in TimSort, once one side wins minGallop times in a row it hands over its
+// whole stretch below the other head through gallop(). minGallop drops while
+// that pays off and grows when it doesn't, so random input, where streaks are
+// short, stays on plain one-by-one comparisons. A side left alone is copied
+// batch by batch.
+template <typename Reader, typename Writer>
+void merge_run(basic_run_reader<Reader>& r1, basic_run_reader<Reader>& r2, Writer& w) {
+    size_t minGallop = MIN_GALLOP;
+    size_t wins1 = 0, wins2 = 0;
+
+    for (;;) {
+        bool a = r1.has_value() && !r1.at_boundary();
+        bool b = r2.has_value() && !r2.at_boundary();
+
+        if (!a && !b)
+            break;
+
+        if (a && b) {
+            if (wins1 >= minGallop || wins2 >= minGallop) {
+                record_view head1 = r1.peek(), head2 = r2.peek();
+                size_t n = wins1 ? r1.gallop(&head2, true, w) : r2.gallop(&head1, false, w);
+                minGallop = n >= MIN_GALLOP ? std::max(minGallop, (size_t)2) - 1 : minGallop + 1;
+                wins1 = wins2 = 0;
+            } else if (r1.peek() <= r2.peek()) {
+                w.write_record(r1.peek());
+                r1.consume();
+                wins1++;
+                wins2 = 0;
+            } else {
+                w.write_record(r2.peek());
+                r2.consume();
+                wins2++;
+                wins1 = 0;
+            }
+        } else if (a) {
+            r1.gallop(nullptr, true, w);
+        } else {
+            r2.gallop(nullptr, true, w);
+        }
+    }
+}
+
+// Splits the natural (non-decreasing) runs of `source` over a set of run writers,
+// calling next_run() at every run boundary. Returns the number of runs.
+template <typename Reader = fast_reader, typename Writers>
+size_t distribute_runs(const std::string& source, Writers& w) {
+    Reader in(source);
+
+    record_batch batch;
+    record last;
+    size_t runs = 0;
+
+    while (in.next_batch(batch)) {
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (!runs) {
+                runs++;
+            } else if (batch.descends(i, last)) {
+                w.next_run();
+                runs++;
+            }
+            w.write_record(batch[i]);
+        }
+        batch.last_key(last);
+    }
+
+    return runs;
+}
+
+// Memory of one merge input: its io.ibuf buffer and a record_batch, whose
+// arena and entries together hold BATCH_BYTES but may have grown to twice that.
+inline size_t merge_input_bytes() {
+    return io.ibuf * (io.async ? 2 : 1) + 2 * BATCH_BYTES;
+}
+
+// Every merge input holds merge_input_bytes(), the output one io.obuf.
+// Asynchronous I/O doubles the buffers. Run generation for a k-way merge
+// writes all k files at once, so write buffers are also kept to half the
+// budget: that leaves the other half to the runs, and k times the run size,
+// what one pass can merge, peaks there.
+inline size_t fan_in_for(size_t memory) {
+    size_t out = io.obuf * (io.async ? 2 : 1);
+    size_t k = memory > out ? (memory - out) / merge_input_bytes() : 0;
+    k = std::min(k, memory / 2 / out);
+    return std::clamp(k, (size_t)2, MAX_FAN_IN);
+}
+
+inline std::vector<std::string> temp_paths(size_t k, const std::string& prefix = "data/t") {
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < k; ++i) {
+        paths.push_back(prefix + std::to_string(i) + io.run_suffix());
+    }
+    return paths;
+}
+
+inline void remove_all(const std::vector<std::string>& paths) {
+    for (const auto& p : paths) {
+        remove(p.c_str());
+    }
+}
+
+// Whether two paths name the same file, also when spelled differently
+// (data/c.txt and ./data/c.txt, links); "-" is stdin or stdout, never a file.
+inline bool same_file(const std::string& a, const std::string& b) {
+    if (a == "-" || b == "-")
+        return false;
+    if (a == b)
+        return true;
+    struct stat sa, sb;
+    return stat(a.c_str(), &sa) == 0 && stat(b.c_str(), &sb) == 0 && sa.st_dev == sb.st_dev &&
+           sa.st_ino == sb.st_ino;
+}
+
+// Moves `from` to `to`: a rename when possible, otherwise (another filesystem,
+// "-" for stdout or a packed run) a copy followed by removing `from`.
+inline void move_file(const std::string& from, const std::string& to) {
+    if (same_file(from, to))
+        return;
+    if (to == indexed.path)
+        indexed.fresh = false;
+    bool copy = to == "-" || packed_path(from);
+    if (!copy && rename(from.c_str(), to.c_str()) == 0)
+        return;
+    if (!copy && errno != EXDEV) {
+        perror("rename");
+        exit(1);
+    }
+
+    {
+        fast_reader in(from);
+        fast_writer out(to);
+        out.index.reset(); // the bytes bypass it; finish_index() reads the file back
+        while (in.refill()) {
+            write_all(out.fd, in.buf.get(), in.len);
+        }
+    }
+    remove(from.c_str());
+}
+
+// Writes the --index sidecar unless the writer that produced the file already
+// did; a rename or a parallel merge leaves it to this extra read.
+inline void finish_index() {
+    if (indexed.path.empty() || indexed.fresh)
+        return;
+
+    index_builder index(indexed.path, KEY_SIZE, indexed.step);
+    fast_reader in(indexed.path);
+    record_batch batch;
+    size_t offset = 0;
+    while (in.next_batch(batch)) {
+        for (size_t i = 0; i < batch.size(); ++i) {
+            index.add(batch.key(i), offset);
+            offset += batch.entries[i].size + 1;
+        }
+    }
+    struct stat st;
+    index.write(stat(indexed.path.c_str(), &st) == 0 ? st.st_size : offset);
+    indexed.fresh = true;
+}
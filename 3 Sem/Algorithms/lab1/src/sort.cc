@@ -1,105 +1,157 @@
+#include "incremental.hh"
+#include "kway.hh"
+#include "mmap_io.hh"
+#include "options.hh"
+#include "planner.hh"
+#include "polyphase.hh"
 #include "shared.hh"
 
 #include <cstdlib>
 #include <iostream>
 #include <string>
 #include <utility>
+#include <vector>
 
+template <typename Reader = fast_reader, typename Writer = fast_writer>
 size_t distribute(const std::string& source, const std::string& fa, const std::string& fb) {
-    fast_reader in(source);
-    fast_writer wA(fa), wB(fb);
+    Reader in(source);
+    Writer wA(fa), wB(fb);
 
-    fast_writer* cur = &wA;
-    fast_writer* other = &wB;
+    Writer* cur = &wA;
+    Writer* other = &wB;
 
+    record_batch batch;
     record last;
-    bool hasLast = false;
     size_t runs = 0;
-    record x;
-
-    while (in.next_record(x)) {
-        if (!hasLast) {
-            runs++;
-            cur->write_record(x);
-            last = x;
-            hasLast = true;
-        } else if (x >= last) {
-            cur->write_record(x);
-            last = x;
-        } else {
-            std::swap(cur, other);
-            runs++;
-            cur->write_record(x);
-            last = x;
+
+    while (in.next_batch(batch)) {
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (!runs) {
+                runs++;
+            } else if (batch.descends(i, last)) {
+                std::swap(cur, other);
+                runs++;
+            }
+            cur->write_record(batch[i]);
         }
+        batch.last_key(last);
     }
 
     return runs;
 }
 
-size_t merge_files(const std::string& f1, const std::string& f2, const std::string& out) {
-    run_reader r1(f1), r2(f2);
-    fast_writer w(out);
+// Merges the runs of `f1` and `f2` pairwise into `outputs`, alternating between
+// them run by run. Returns the number of merged runs.
+template <typename Reader = fast_reader, typename Writer = fast_writer>
+size_t merge_files(const std::string& f1, const std::string& f2, const std::vector<std::string>& outputs) {
+    basic_run_reader<Reader> r1(f1), r2(f2);
+    run_writers<Writer> w(outputs);
     size_t run_count = 0;
 
     while (r1.has_value() || r2.has_value()) {
         run_count++;
 
-        // merge one run
-        for (;;) {
-            bool a = r1.has_value() && !r1.at_boundary();
-            bool b = r2.has_value() && !r2.at_boundary();
-
-            if (!a && !b)
-                break;
-
-            if (a && b) {
-                if (r1.peek() <= r2.peek()) {
-                    w.write_record(r1.peek());
-                    r1.consume();
-                } else {
-                    w.write_record(r2.peek());
-                    r2.consume();
-                }
-            } else if (a) {
-                w.write_record(r1.peek());
-                r1.consume();
-            } else {
-                w.write_record(r2.peek());
-                r2.consume();
-            }
-        }
+        merge_run(r1, r2, w);
 
         if (r1.at_boundary())
             r1.clear_boundary();
         if (r2.at_boundary())
             r2.clear_boundary();
+        w.next_run();
     }
 
     return run_count;
 }
 
-void natural_merge_sort(
-    const std::string& path,
-    const std::string& a = "data/a.txt",
-    const std::string& b = "data/b.txt"
-) {
-    while (true) {
-        size_t runs = distribute(path, a, b);
-        if (runs <= 1)
-            break;
-        size_t merged = merge_files(a, b, path);
-        if (merged <= 1)
-            break;
+// Returns the number of merge passes.
+template <typename Reader = fast_reader, typename Writer = fast_writer>
+size_t natural_merge_sort(const options& opts) {
+    const std::string& input = opts.input;
+    const std::string& output = opts.output;
+
+    plan p = make_plan(opts);
+    if (p.in_memory) {
+        metrics.begin();
+        sort_in_memory<Writer>(input, output);
+        metrics.end("in-memory", 0, 1);
+        return 0;
+    }
+
+    if (opts.merge == merge_strategy::kway) {
+        auto temps = temp_paths(p.fan_in, opts.temp("t"));
+        size_t passes = kway_merge_sort<Reader, Writer>(input, output, temps, opts.work());
+        remove_all(temps);
+        if (!same_file(opts.work(), output))
+            remove(opts.work().c_str());
+        return passes;
     }
 
-    remove(a.c_str());
-    remove(b.c_str());
+    if (opts.merge == merge_strategy::polyphase) {
+        auto temps = temp_paths(opts.tapes ? opts.tapes : tapes_for(opts.memory), opts.temp("t"));
+        polyphase tapes(temps);
+        metrics.begin();
+        distribute_runs<Reader>(input, tapes);
+        size_t passes = tapes.merge_into(output);
+        remove_all(temps);
+        return passes;
+    }
+
+    // Balanced merge over four files: the input is distributed once, then every
+    // pass merges a/b into a2/b2 run by run and the pairs swap roles. Adjacent
+    // runs on one file may come out in order and read back as one, which only
+    // helps. A merge of at most two runs is the last one and goes to the output.
+    std::string a = opts.run_file("a"), b = opts.run_file("b");
+    std::string c = opts.run_file("a2"), d = opts.run_file("b2"); // not "c": data/c.txt is the input
+    metrics.begin();
+    size_t runs = distribute<Reader, Writer>(input, a, b);
+    metrics.end("distribute", 0, runs);
+
+    size_t passes = 0;
+    if (runs <= 1) {
+        if (!same_file(input, output))
+            move_file(a, output);
+    } else {
+        while (true) {
+            passes++;
+            metrics.begin();
+            if (runs <= 2) {
+                metrics.end("merge", runs, merge_files<Reader, Writer>(a, b, {output}));
+                break;
+            }
+            size_t merged = merge_files<Reader, Writer>(a, b, {c, d});
+            metrics.end("merge", runs, merged);
+            runs = merged;
+            std::swap(a, c);
+            std::swap(b, d);
+        }
+    }
+
+    remove_all({a, b, c, d});
+    return passes;
 }
 
 int main(int argc, char** argv) {
     std::ios::sync_with_stdio(false);
     std::cin.tie(nullptr);
 
-    natural_merge_sort("data/c.txt");
+    options opts = parse_options(argc, argv);
+    if (opts.top || !opts.range.all() || opts.partitions) {
+        std::cerr << "--top, --from, --to and --partitions are sort_mod options\n";
+        return 1;
+    }
+    if (opts.runs == run_strategy::replacement || opts.merge == merge_strategy::parallel || opts.threads > 1) {
+        std::cerr << "--runs=replacement, --merge=parallel and --threads are sort_mod options\n";
+        return 1;
+    }
+    size_t passes;
+    if (opts.mmap && opts.incremental)
+        passes = incremental_sort<mmap_reader, mmap_writer>(opts, natural_merge_sort<mmap_reader, mmap_writer>);
+    else if (opts.mmap)
+        passes = natural_merge_sort<mmap_reader, mmap_writer>(opts);
+    else if (opts.incremental)
+        passes = incremental_sort(opts, natural_merge_sort<>);
+    else
+        passes = natural_merge_sort(opts);
+    finish_index();
+    std::cerr << "merge passes: " << passes << "\n";
 }
@@ -1,33 +1,66 @@
+#include "options.hh"
+#include "packed_key.hh"
+#include "planner.hh"
+#include "radix.hh"
+
 #include <algorithm>
+#include <cstdint>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <queue>
 #include <string>
+#include <string_view>
 #include <vector>
 
 // priority_queue - log n
 // sort - n log n
 
-const size_t MAX_MEMORY = 100 * 1024 * 1024; // 100 MB for buffer
-const std::string TMP_PREFIX = "chunk_";
+std::string_view get_key(const std::string& line) {
+    return std::string_view(line).substr(0, 5);
+}
 
 struct Record {
-    std::string key;
+    uint64_t key; // pack_key(get_key(line))
     std::string line;
-
-    bool operator<(const Record& o) const {
-        return key < o.key;
-    }
 };
 
-std::string get_key(const std::string& line) {
-    return line.substr(0, 5);
+// Radix sorts the packed keys and writes the chunk in that order, without
+// moving the records.
+void write_chunk(const std::vector<Record>& buffer, std::ostream& out) {
+    std::vector<key_index> order(buffer.size());
+    for (size_t i = 0; i < buffer.size(); ++i)
+        order[i] = {buffer[i].key, (uint32_t)i};
+    radix_sort(order, [&](const key_index& a, const key_index& b) {
+        return get_key(buffer[a.index].line) < get_key(buffer[b.index].line);
+    });
+
+    for (const auto& e : order)
+        out << buffer[e.index].line << '\n';
 }
 
 int main(int argc, char* argv[]) {
-    std::string infile = "data/c.txt", outfile = "data/c.txt";
-    std::ifstream in(infile);
+    std::ios::sync_with_stdio(false);
+
+    // --input/--output/--tmp, "-" for stdin/stdout
+    options opts = parse_options(argc, argv);
+    if (opts.top || !opts.range.all() || opts.partitions) {
+        std::cerr << "--top, --from, --to and --partitions are sort_mod options\n";
+        return 1;
+    }
+    // the rest would be silently ignored: there is one merge over iostreams
+    if (opts.runs != run_strategy::block || opts.merge != merge_strategy::two_way || opts.tapes ||
+        opts.threads > 1 || opts.mmap || io.async || io.compress || opts.incremental || !opts.stats.empty()) {
+        std::cerr << "sort_ai only takes --memory, --index, --input, --output and --tmp\n";
+        return 1;
+    }
+    const std::string TMP_PREFIX = opts.temp("chunk_");
+    const size_t MAX_MEMORY = make_plan(opts).run_bytes; // buffer, from --memory
+
+    std::ifstream file;
+    if (opts.input != "-")
+        file.open(opts.input);
+    std::istream& in = opts.input == "-" ? std::cin : file;
     if (!in) {
         std::cerr << "Cannot open input\n";
         return 1;
@@ -41,39 +74,49 @@ int main(int argc, char* argv[]) {
     std::string line;
     while (getline(in, line)) {
         current_mem += line.size() + sizeof(Record);
-        buffer.push_back({get_key(line), line});
+        buffer.push_back({pack_key(get_key(line)), line});
         if (current_mem >= MAX_MEMORY) {
-            sort(buffer.begin(), buffer.end());
             std::string chunk_name = TMP_PREFIX + std::to_string(chunk_idx++) + ".txt";
-            std::ofstream out(chunk_name);
-            for (auto& r : buffer)
-                out << r.line << '\n';
-            out.close();
+            std::ofstream chunk(chunk_name);
+            write_chunk(buffer, chunk);
             chunk_files.push_back(chunk_name);
             buffer.clear();
             current_mem = 0;
         }
     }
 
+    file.close();
+
+    std::ofstream outfile;
+    if (opts.output != "-")
+        outfile.open(opts.output);
+    std::ostream& out = opts.output == "-" ? std::cout : outfile;
+
+    // everything fit in the buffer: no chunks, no merge
+    if (chunk_files.empty()) {
+        write_chunk(buffer, out);
+        out.flush();
+        finish_index();
+        std::cerr << "merge passes: 0\n";
+        std::cerr << "Sorting done. Output: " << opts.output << "\n";
+        return 0;
+    }
+
     if (!buffer.empty()) {
-        sort(buffer.begin(), buffer.end());
         std::string chunk_name = TMP_PREFIX + std::to_string(chunk_idx++) + ".txt";
-        std::ofstream out(chunk_name);
-        for (auto& r : buffer)
-            out << r.line << '\n';
-        out.close();
+        std::ofstream chunk(chunk_name);
+        write_chunk(buffer, chunk);
         chunk_files.push_back(chunk_name);
     }
-    in.close();
 
     // --- Merge Phase ---
     struct Node {
-        std::string key;
+        uint64_t key;
         std::string line;
         int file_id;
 
         bool operator>(const Node& o) const {
-            return key > o.key;
+            return key_less(o.key, get_key(o.line), key, get_key(line));
         }
     };
 
@@ -82,24 +125,26 @@ int main(int argc, char* argv[]) {
     for (int i = 0; i < (int)chunk_files.size(); ++i) {
         files[i].open(chunk_files[i]);
         if (getline(files[i], line))
-            pq.push({get_key(line), line, i});
+            pq.push({pack_key(get_key(line)), line, i});
     }
 
-    std::ofstream out(outfile);
     while (!pq.empty()) {
         auto cur = pq.top();
         pq.pop();
         out << cur.line << '\n';
         if (getline(files[cur.file_id], line))
-            pq.push({get_key(line), line, cur.file_id});
+            pq.push({pack_key(get_key(line)), line, cur.file_id});
     }
-    out.close();
+    out.flush();
+    outfile.close();
 
     for (auto& f : files)
         f.close();
     for (auto& f : chunk_files)
         remove(f.c_str());
 
-    std::cerr << "Sorting done. Output: " << outfile << "\n";
+    finish_index();
+    std::cerr << "merge passes: 1\n";
+    std::cerr << "Sorting done. Output: " << opts.output << "\n";
     return 0;
 }
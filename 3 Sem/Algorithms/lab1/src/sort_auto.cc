@@ -0,0 +1,247 @@
+#include "options.hh"
+#include "planner.hh"
+#include "proc.hh"
+#include "shared.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Picks a sorter for the input and runs it. A sample of the input tells how
+// presorted it is; the estimates and the choice go to stderr, then sort or
+// sort_mod takes over with every option passed on. Strategy flags given on the
+// command line come after the chosen ones and win.
+
+static const size_t SAMPLE_WINDOWS = 16;
+static const size_t WINDOW_BYTES = 256 << 10;
+static const size_t SAMPLE_PAIRS = 1 << 14;
+
+struct presortedness {
+    size_t sampled = 0;    // records in the sample
+    size_t records = 0;    // in the whole input, 0 - unknown (stdin)
+    double runs = 0;       // natural runs in the whole input, 0 - unknown
+    double descents = 0;   // share of adjacent records out of order
+    double inversions = 0; // share of sampled pairs out of order: 0 sorted, ~0.5 random, 1 reversed
+    double duplicates = 0; // share of sampled records whose key repeats another sampled one
+    double runBytes = 0;   // average natural run, infinite if the sample had no descent
+};
+
+// Samples of the input, in input order. Windows are read at evenly spaced
+// offsets; lines cut by a window edge are dropped.
+struct input_sample {
+    std::vector<std::vector<uint64_t>> windows; // packed keys
+    size_t records = 0;
+    size_t lineBytes = 0;
+
+    void add(const char* p, size_t n, bool atStart) {
+        size_t from = 0;
+        if (!atStart) {
+            const char* nl = static_cast<const char*>(memchr(p, '\n', n));
+            if (!nl)
+                return;
+            from = nl + 1 - p;
+        }
+        const char* last = static_cast<const char*>(memrchr(p, '\n', n));
+        if (!last || (size_t)(last + 1 - p) <= from)
+            return;
+
+        record_batch b;
+        b.arena.assign(p, p + n);
+        size_t good = b.index_lines(from, last + 1 - p);
+        std::vector<uint64_t> keys;
+        for (const auto& e : b.entries) {
+            keys.push_back(e.packed);
+        }
+        records += keys.size();
+        lineBytes += good - from;
+        windows.push_back(std::move(keys));
+    }
+};
+
+static input_sample sample_file(const std::string& path, size_t size) {
+    input_sample s;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+
+    size_t windows = std::clamp(size / WINDOW_BYTES, (size_t)1, SAMPLE_WINDOWS);
+    std::vector<char> buf(std::min(size, WINDOW_BYTES));
+    for (size_t w = 0; w < windows; ++w) {
+        size_t offset = windows > 1 ? (size - buf.size()) / (windows - 1) * w : 0;
+        ssize_t n = pread(fd, buf.data(), buf.size(), offset);
+        if (n < 0) {
+            perror("read");
+            exit(1);
+        }
+        s.add(buf.data(), n, offset == 0);
+    }
+    close(fd);
+    return s;
+}
+
+static presortedness estimate(const input_sample& s, size_t size) {
+    presortedness e;
+    std::vector<uint64_t> all;
+    size_t pairs = 0, descents = 0;
+    for (const auto& w : s.windows) {
+        for (size_t i = 1; i < w.size(); ++i) {
+            descents += w[i] < w[i - 1];
+        }
+        pairs += w.empty() ? 0 : w.size() - 1;
+        all.insert(all.end(), w.begin(), w.end());
+    }
+    e.sampled = all.size();
+    if (all.size() < 2)
+        return e;
+
+    // fixed seed: the same input always gets the same sorter
+    std::mt19937_64 rng(0);
+    size_t inverted = 0;
+    for (size_t k = 0; k < SAMPLE_PAIRS; ++k) {
+        size_t i = rng() % all.size(), j = rng() % all.size();
+        if (i > j)
+            std::swap(i, j);
+        inverted += all[j] < all[i];
+    }
+
+    // the sample's descents scale to the whole input: a sorted input is one run
+    // however large, a random one has half as many runs as records
+    double lineBytes = (double)s.lineBytes / s.records;
+    e.descents = pairs ? (double)descents / pairs : 0;
+    e.inversions = (double)inverted / SAMPLE_PAIRS;
+    e.runBytes = e.descents > 0 ? lineBytes / e.descents : std::numeric_limits<double>::infinity();
+    if (size) {
+        e.records = size / lineBytes;
+        e.runs = std::max(1.0, e.descents * e.records);
+    }
+
+    std::sort(all.begin(), all.end());
+    size_t repeats = 0;
+    for (size_t i = 1; i < all.size(); ++i) {
+        repeats += all[i] == all[i - 1];
+    }
+    e.duplicates = (double)repeats / all.size();
+    return e;
+}
+
+struct choice {
+    std::string sorter;
+    std::vector<std::string> flags;
+    const char* why;
+};
+
+// Natural runs need no sorting, so they win when there are few enough to merge
+// in one pass (or, for stdin, when they are longer than a block run). Block
+// runs are the fastest to produce otherwise. Replacement selection is slower
+// per record, but on mostly ordered input its runs keep growing, so it pays off
+// once blocks would need more than one merge pass.
+static choice choose(const options& opts, const presortedness& e, const plan& p, size_t size) {
+    if (opts.top || !opts.range.all() || opts.partitions)
+        return {"sort_mod", {}, "only sort_mod does top-k, key ranges and partitions"};
+    if (opts.runs == run_strategy::replacement || opts.merge == merge_strategy::parallel || opts.threads > 1)
+        return {"sort_mod", {}, "only sort_mod does replacement selection and threads"};
+    if (p.in_memory)
+        return {"sort_mod", {}, "fits in memory"};
+    if (e.sampled < 2)
+        return {"sort_mod", {"--runs=block", "--merge=kway"}, "too little input to sample"};
+    if (size ? e.runs <= p.fan_in : e.runBytes >= p.run_bytes)
+        return {"sort", {"--merge=kway"}, "few natural runs"};
+
+    std::vector<std::string> blockRuns = {"--runs=block", "--merge=kway"};
+    if (!size)
+        return {"sort_mod", blockRuns, "input of unknown size, long natural runs unlikely"};
+    size_t blocks = size / p.run_bytes + 1;
+    if (blocks <= p.fan_in)
+        return {"sort_mod", blockRuns, "block runs merge in one pass"};
+    if (e.inversions < 0.1)
+        return {"sort_mod", {"--runs=replacement", "--merge=kway"}, "mostly ordered, too many blocks for one pass"};
+    return {"sort_mod", blockRuns, "too many blocks for one pass, too disordered for longer runs"};
+}
+
+// Runs `args` with its stdin fed from `head` followed by the rest of ours.
+[[noreturn]] static void exec_with_head(const std::vector<std::string>& args, const std::vector<char>& head) {
+    int in[2];
+    if (pipe(in) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        close(in[0]);
+        close(in[1]);
+        exec(args);
+    }
+
+    close(in[0]);
+    write_all(in[1], head.data(), head.size());
+    std::vector<char> buf(io.ibuf);
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, buf.data(), buf.size())) > 0) {
+        write_all(in[1], buf.data(), n);
+    }
+    close(in[1]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+}
+
+int main(int argc, char** argv) {
+    options opts = parse_options(argc, argv);
+    plan p = make_plan(opts, false);
+
+    size_t size = input_size(opts.input);
+    input_sample s;
+    std::vector<char> head;
+    if (opts.input == "-") {
+        head.resize(SAMPLE_WINDOWS * WINDOW_BYTES);
+        size_t got = 0;
+        ssize_t n;
+        while (got < head.size() && (n = read(STDIN_FILENO, head.data() + got, head.size() - got)) > 0) {
+            got += n;
+        }
+        head.resize(got);
+        s.add(head.data(), head.size(), true);
+    } else {
+        s = sample_file(opts.input, size);
+    }
+
+    presortedness e = estimate(s, size);
+    choice c = choose(opts, e, p, size);
+
+    std::cerr << "presortedness: ";
+    if (size)
+        std::cerr << "~" << e.records << " records, ~" << (size_t)e.runs << " runs, ";
+    std::cerr << "descents " << e.descents * 100 << "%, inversions " << e.inversions * 100
+              << "%, duplicates " << e.duplicates * 100 << "%\n"
+              << "strategy: " << c.sorter;
+    for (const auto& f : c.flags) {
+        std::cerr << " " << f;
+    }
+    std::cerr << " (" << c.why << ")\n";
+
+    std::vector<std::string> args = {self_dir() + "/" + c.sorter};
+    args.insert(args.end(), c.flags.begin(), c.flags.end());
+    args.insert(args.end(), argv + 1, argv + argc);
+
+    if (opts.input == "-")
+        exec_with_head(args, head);
+    exec(args);
+}
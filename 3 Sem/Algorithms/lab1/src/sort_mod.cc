@@ -1,106 +1,349 @@
+#include "incremental.hh"
+#include "kway.hh"
+#include "mmap_io.hh"
+#include "options.hh"
+#include "parallel_merge.hh"
+#include "partition.hh"
+#include "planner.hh"
+#include "polyphase.hh"
+#include "radix.hh"
 #include "shared.hh"
+#include "top_k.hh"
 
 #include <algorithm>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <utility>
 #include <vector>
 
+template <typename Reader = fast_reader, typename Writer = fast_writer>
 size_t distribute(const std::string& source, const std::string& fa, const std::string& fb) {
-    fast_reader in(source);
-    fast_writer wA(fa), wB(fb);
+    Reader in(source);
+    Writer wA(fa), wB(fb);
 
-    fast_writer* cur = &wA;
-    fast_writer* other = &wB;
+    Writer* cur = &wA;
+    Writer* other = &wB;
 
+    record_batch batch;
     record last;
-    bool hasLast = false;
     size_t runs = 0;
-    record x;
-
-    while (in.next_record(x)) {
-        if (!hasLast) {
-            runs++;
-            cur->write_record(x);
-            last = x;
-            hasLast = true;
-        } else if (x >= last) {
-            cur->write_record(x);
-            last = x;
-        } else {
-            std::swap(cur, other);
-            runs++;
-            cur->write_record(x);
-            last = x;
+
+    while (in.next_batch(batch)) {
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (!runs) {
+                runs++;
+            } else if (batch.descends(i, last)) {
+                std::swap(cur, other);
+                runs++;
+            }
+            cur->write_record(batch[i]);
         }
+        batch.last_key(last);
     }
 
     return runs;
 }
 
-void initial_distribute(const std::string& source, const std::string& fa, const std::string& fb) {
-    fast_reader in(source);
-    fast_writer wA(fa), wB(fb);
+struct run_stats {
+    size_t runs = 0;
+    size_t records = 0;
+};
+
+// Cuts a run every `blockBytes` of record_batch memory. Like the other run
+// generators, drops records outside `range` as they are read.
+template <typename Reader = fast_reader, typename Writers>
+run_stats initial_distribute(const std::string& source, Writers& w, size_t blockBytes, const key_range& range) {
+    Reader in(source);
 
-    fast_writer* cur = &wA;
-    fast_writer* other = &wB;
+    record_batch block;
+    run_stats stats;
 
-    std::vector<record> block;
-    const size_t blockSize = 1'000'000;
-    record x;
+    // radix sort the keys, records are only touched again when written out
+    auto emit = [&] {
+        w.write_batch(block, sorted_order(block));
+        stats.runs++;
+        stats.records += block.size();
+        block.clear();
+    };
 
-    while (in.next_record(x)) {
-        block.push_back(x);
-        if (block.size() >= blockSize) {
-            std::sort(block.begin(), block.end());
-            for (const auto& r : block) {
-                cur->write_record(r);
+    while (append_in_range(in, block, range)) {
+        if (block.bytes() >= blockBytes) {
+            emit();
+            w.next_run();
+        }
+    }
+
+    if (!block.empty())
+        emit();
+
+    return stats;
+}
+
+// Pipelined block run generation: this thread parses, `threads` workers sort
+// blocks concurrently and a writer thread emits finished runs in input order.
+// There are threads + 2 slots (parsing, sorting, writing), each a block of
+// memory / (threads + 2) bytes with its sort order; a written slot is cleared
+// and handed back to the parser with its capacity, and every worker keeps its
+// radix scratch. A slot and its share of the scratch take about twice the
+// block, as a single block of `memory` bytes does in initial_distribute(), so
+// the planner's budget for it holds.
+template <typename Reader = fast_reader, typename Writers>
+run_stats parallel_distribute(
+    const std::string& source, Writers& w, size_t memory, size_t threads, const key_range& range
+) {
+    using block = record_batch;
+    using sorted_block = std::pair<block, std::vector<key_index>>;
+
+    const size_t slots = threads + 2;
+    const size_t blockBytes = std::clamp(memory / slots, (size_t)1, (size_t)1 << 31);
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<std::pair<size_t, sorted_block>> todo; // parsed, waiting for a worker
+    std::map<size_t, sorted_block> done;              // sorted, waiting for the writer
+    std::vector<sorted_block> spare;                  // written, ready for reuse
+    size_t inFlight = 0;
+    size_t parsed = 0;
+    bool eof = false;
+    run_stats stats;
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([&] {
+            std::vector<key_index> tmp;
+            std::unique_lock lock(m);
+            while (true) {
+                cv.wait(lock, [&] {
+                    return !todo.empty() || eof;
+                });
+                if (todo.empty())
+                    return;
+
+                auto [seq, s] = std::move(todo.front());
+                todo.pop_front();
+                lock.unlock();
+                sorted_order(s.first, s.second, tmp);
+                lock.lock();
+
+                done.emplace(seq, std::move(s));
+                cv.notify_all();
             }
-            std::swap(cur, other);
-            block.clear();
+        });
+    }
+
+    std::thread writer([&] {
+        std::unique_lock lock(m);
+        for (size_t next = 0;; ++next) {
+            cv.wait(lock, [&] {
+                return done.count(next) || (eof && next == parsed);
+            });
+            auto it = done.find(next);
+            if (it == done.end())
+                return;
+            sorted_block s = std::move(it->second);
+            done.erase(it);
+            lock.unlock();
+
+            w.write_batch(s.first, s.second);
+            w.next_run();
+            stats.runs++;
+            stats.records += s.first.size();
+            s.first.clear();
+            s.second.clear();
+
+            lock.lock();
+            spare.push_back(std::move(s));
+            inFlight--;
+            cv.notify_all();
         }
+    });
+
+    Reader in(source);
+    sorted_block s;
+    bool holding = false; // s is a slot
+
+    while (true) {
+        if (!holding) {
+            std::unique_lock lock(m);
+            cv.wait(lock, [&] {
+                return inFlight < slots;
+            });
+            inFlight++;
+            holding = true;
+            if (!spare.empty()) {
+                s = std::move(spare.back());
+                spare.pop_back();
+            } else {
+                // a new slot never grows by doubling; pages are only touched as it fills
+                s.first.arena.reserve(blockBytes + BATCH_BYTES);
+                s.first.entries.reserve((blockBytes + BATCH_BYTES) / sizeof(block::entry));
+            }
+        }
+
+        block& b = s.first;
+        if (!append_in_range(in, b, range))
+            break;
+
+        if (b.bytes() >= blockBytes) {
+            std::lock_guard lock(m);
+            todo.emplace_back(parsed++, std::move(s));
+            cv.notify_all();
+            s = sorted_block();
+            holding = false;
+        }
+    }
+
+    {
+        std::lock_guard lock(m);
+        if (!s.first.empty())
+            todo.emplace_back(parsed++, std::move(s));
+        else
+            inFlight--;
+        eof = true;
+    }
+    cv.notify_all();
+
+    for (auto& t : workers) {
+        t.join();
+    }
+    writer.join();
+
+    return stats;
+}
+
+// Replacement selection: keeps `capacity` bytes of records in a heap ordered by
+// (run, key). A record smaller than the last one written can't extend the
+// current run, so it is tagged for the next one. On random input runs average
+// 2 * capacity.
+//
+// Lines are copied into an arena and heap nodes only point at them, so the heap
+// holds as many records as a block of the same size would. A written record's
+// line stays in the arena as garbage; once there is as much garbage as live
+// lines, the live ones are moved down to the front. The arena then never holds
+// more than twice the heap's lines, the share a block spends on radix sorting.
+template <typename Reader = fast_reader, typename Writers>
+run_stats replacement_distribute(const std::string& source, Writers& w, size_t capacity, const key_range& range) {
+    struct node {
+        uint64_t packed;
+        uint32_t run;
+        uint32_t size; // line length without '\n'
+        size_t offset; // in the arena
+    };
+
+    Reader in(source);
+    record_batch batch; // input
+    size_t next = 0;
+    auto read = [&] {
+        while (next == batch.size()) {
+            next = 0; // next_batch() clears the batch even at the end
+            if (!in.next_batch(batch))
+                return false;
+            batch.filter(0, range);
+        }
+        next++;
+        return true;
+    };
+
+    std::vector<char> arena;
+    size_t live = 0; // arena bytes of the records in the heap
+    auto store = [&](size_t i, uint32_t run) {
+        std::string_view line = batch.line(i);
+        size_t offset = arena.size();
+        arena.insert(arena.end(), line.begin(), line.end());
+        arena.push_back('\n');
+        live += line.size() + 1;
+        return node{batch.entries[i].packed, run, (uint32_t)line.size(), offset};
+    };
+    auto key = [&](const node& n) {
+        return std::string_view(arena.data() + n.offset, KEY_SIZE);
+    };
+
+    // std::*_heap builds a max-heap, so "greater" puts the smallest (run, key) on top
+    auto greater = [&](const node& a, const node& b) {
+        if (a.run != b.run)
+            return a.run > b.run;
+        return key_less(b.packed, key(b), a.packed, key(a));
+    };
+
+    std::vector<node> heap;
+    run_stats stats;
+
+    // the heap is filled up to `capacity` bytes, after that its size is fixed
+    while (live + heap.size() * sizeof(node) < capacity && read()) {
+        heap.push_back(store(next - 1, 0));
     }
+    std::make_heap(heap.begin(), heap.end(), greater);
 
-    if (!block.empty()) {
-        std::sort(block.begin(), block.end());
-        for (const auto& r : block) {
-            cur->write_record(r);
+    std::vector<size_t> byOffset;
+    uint32_t run = 0;
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        node top = heap.back();
+        heap.pop_back();
+
+        if (stats.records == 0) {
+            stats.runs = 1;
+        } else if (top.run != run) {
+            w.next_run();
+            stats.runs++;
         }
+        run = top.run;
+
+        const char* p = arena.data() + top.offset;
+        w.write_record(record_view{
+            std::string_view(p, KEY_SIZE),
+            std::string_view(p + KEY_SIZE + 1, top.size - KEY_SIZE - 1),
+            top.packed,
+        });
+        stats.records++;
+        live -= top.size + 1;
+
+        if (!read())
+            continue;
+        size_t i = next - 1;
+        bool smaller = key_less(batch.entries[i].packed, batch.key(i), top.packed, key(top));
+
+        if (arena.size() - live >= live) {
+            // heap order doesn't depend on offsets, so nodes move in place
+            byOffset.resize(heap.size());
+            for (size_t j = 0; j < heap.size(); ++j) {
+                byOffset[j] = j;
+            }
+            std::sort(byOffset.begin(), byOffset.end(), [&](size_t a, size_t b) {
+                return heap[a].offset < heap[b].offset;
+            });
+            size_t pos = 0;
+            for (size_t j : byOffset) {
+                node& n = heap[j];
+                memmove(arena.data() + pos, arena.data() + n.offset, n.size + 1);
+                n.offset = pos;
+                pos += n.size + 1;
+            }
+            arena.resize(pos);
+        }
+
+        heap.push_back(store(i, smaller ? run + 1 : run));
+        std::push_heap(heap.begin(), heap.end(), greater);
     }
+
+    return stats;
 }
 
+template <typename Reader = fast_reader, typename Writer = fast_writer>
 size_t merge_files(const std::string& f1, const std::string& f2, const std::string& out) {
-    run_reader r1(f1), r2(f2);
-    fast_writer w(out);
+    basic_run_reader<Reader> r1(f1), r2(f2);
+    Writer w(out);
     size_t run_count = 0;
 
     while (r1.has_value() || r2.has_value()) {
         run_count++;
 
-        // merge one run
-        for (;;) {
-            bool a = r1.has_value() && !r1.at_boundary();
-            bool b = r2.has_value() && !r2.at_boundary();
-
-            if (!a && !b)
-                break;
-
-            if (a && b) {
-                if (r1.peek() <= r2.peek()) {
-                    w.write_record(r1.peek());
-                    r1.consume();
-                } else {
-                    w.write_record(r2.peek());
-                    r2.consume();
-                }
-            } else if (a) {
-                w.write_record(r1.peek());
-                r1.consume();
-            } else {
-                w.write_record(r2.peek());
-                r2.consume();
-            }
-        }
+        merge_run(r1, r2, w);
 
         if (r1.at_boundary())
             r1.clear_boundary();
@@ -111,35 +354,173 @@ size_t merge_files(const std::string& f1, const std::string& f2, const std::stri
     return run_count;
 }
 
-void natural_merge_sort(
-    const std::string& path,
-    const std::string& a = "data/a.txt",
-    const std::string& b = "data/b.txt"
-) {
-    initial_distribute(path, a, b);
-    size_t merged = merge_files(a, b, path);
-    if (merged <= 1) {
+// Returns the number of merge passes.
+template <typename Reader = fast_reader, typename Writer = fast_writer>
+size_t natural_merge_sort(const options& opts) {
+    const std::string& output = opts.output;
+    const std::string work = opts.work();
+
+    if (opts.top) {
+        metrics.begin();
+        size_t kept = top_k<Reader, Writer>(opts.input, output, opts.top, opts.range);
+        metrics.end("top-k", 0, 1);
+        std::cerr << "top " << opts.top << ": " << kept << " records\n";
+        return 0;
+    }
+
+    plan p = make_plan(opts);
+    if (p.in_memory && !opts.partitions) {
+        metrics.begin();
+        sort_in_memory<Writer>(opts.input, output, opts.range);
+        metrics.end("in-memory", 0, 1);
+        return 0;
+    }
+
+    // the input is read once, by run generation, so it may be a pipe; the pass
+    // ends in `metrics` once the caller has closed the writers
+    auto generate = [&](auto& w) {
+        metrics.begin();
+        run_stats stats;
+        if (opts.runs == run_strategy::replacement)
+            stats = replacement_distribute<Reader>(opts.input, w, p.run_bytes, opts.range);
+        else if (opts.threads > 1)
+            stats = parallel_distribute<Reader>(opts.input, w, p.run_bytes, opts.threads, opts.range);
+        else
+            stats = initial_distribute<Reader>(opts.input, w, p.run_bytes, opts.range);
+        std::cerr << "initial runs: " << stats.runs << ", avg run length: "
+                  << (stats.runs ? stats.records / stats.runs : 0) << " records\n";
+        return stats;
+    };
+
+    // one pass over all runs, as in the parallel merge, with every key range
+    // written to a file of its own
+    if (opts.partitions) {
+        std::string a = opts.temp("a.txt");
+        std::vector<run_span> runs;
+        {
+            run_writers<Writer> w({a}, true);
+            generate(w);
+            runs = w.finish();
+        }
+        metrics.end("runs", 0, runs.size());
+
+        auto paths = partition_paths(output, opts.partitions);
+        metrics.begin();
+        auto ranges = merge_ranges({a}, runs, paths, opts.partitions, opts.threads);
+        metrics.end("merge", runs.size(), opts.partitions);
+        write_manifest(output, paths, ranges);
+        remove(a.c_str());
+        std::cerr << "partitions: " << opts.partitions << ", manifest " << manifest_path(output) << "\n";
+        return 1;
+    }
+
+    if (opts.merge == merge_strategy::kway) {
+        auto temps = temp_paths(p.fan_in, opts.temp("t"));
+        run_stats stats;
+        {
+            run_writers<Writer> w(temps);
+            stats = generate(w);
+        }
+        metrics.end("runs", 0, stats.runs);
+
+        // with at most one run per file the first merge is the last one
+        bool last = stats.runs <= temps.size();
+        size_t passes = 1;
+        metrics.begin();
+        size_t merged = merge_k<Reader, Writer>(temps, last ? output : work);
+        metrics.end("merge", stats.runs, merged);
+        if (!last && merged <= 1)
+            move_file(work, output);
+        else if (!last)
+            passes += kway_merge_sort<Reader, Writer>(work, output, temps, work, merged);
+        remove_all(temps);
+        if (!same_file(work, output))
+            remove(work.c_str());
+        return passes;
+    }
+
+    if (opts.merge == merge_strategy::parallel) {
+        std::string a = opts.temp("a.txt");
+        std::vector<run_span> runs;
+        {
+            run_writers<Writer> w({a}, true);
+            generate(w);
+            runs = w.finish();
+        }
+        metrics.end("runs", 0, runs.size());
+
+        // segments are written at their offsets, so stdout gets a copy
+        metrics.begin();
+        parallel_merge({a}, runs, work, opts.threads);
+        metrics.end("merge", runs.size(), 1);
+        move_file(work, output);
         remove(a.c_str());
-        remove(b.c_str());
-        return;
+        return 1;
+    }
+
+    if (opts.merge == merge_strategy::polyphase) {
+        auto temps = temp_paths(opts.tapes ? opts.tapes : tapes_for(opts.memory), opts.temp("t"));
+        polyphase tapes(temps);
+        generate(tapes);
+        size_t passes = tapes.merge_into(output);
+        remove_all(temps);
+        return passes;
+    }
+
+    std::string a = opts.run_file("a"), b = opts.run_file("b");
+    run_stats stats;
+    {
+        run_writers<Writer> w({a, b});
+        stats = generate(w);
     }
+    metrics.end("runs", 0, stats.runs);
 
+    // a merge of at most two runs is the last one and goes to the output
+    size_t runs = stats.runs;
+    size_t passes = 0;
     while (true) {
-        size_t runs = distribute(path, a, b);
-        if (runs <= 1)
+        passes++;
+        metrics.begin();
+        if (runs <= 2) {
+            metrics.end("merge", runs, merge_files<Reader, Writer>(a, b, output));
             break;
-        merged = merge_files(a, b, path);
-        if (merged <= 1)
+        }
+        size_t merged = merge_files<Reader, Writer>(a, b, work);
+        metrics.end("merge", runs, merged);
+        if (merged <= 1) {
+            move_file(work, output);
             break;
+        }
+        metrics.begin();
+        runs = distribute<Reader, Writer>(work, a, b);
+        metrics.end("distribute", merged, runs);
+        if (runs <= 1) {
+            move_file(work, output);
+            break;
+        }
     }
 
     remove(a.c_str());
     remove(b.c_str());
+    if (!same_file(work, output))
+        remove(work.c_str());
+    return passes;
 }
 
 int main(int argc, char** argv) {
     std::ios::sync_with_stdio(false);
     std::cin.tie(nullptr);
 
-    natural_merge_sort("data/c.txt");
+    options opts = parse_options(argc, argv);
+    size_t passes;
+    if (opts.mmap && opts.incremental)
+        passes = incremental_sort<mmap_reader, mmap_writer>(opts, natural_merge_sort<mmap_reader, mmap_writer>);
+    else if (opts.mmap)
+        passes = natural_merge_sort<mmap_reader, mmap_writer>(opts);
+    else if (opts.incremental)
+        passes = incremental_sort(opts, natural_merge_sort<>);
+    else
+        passes = natural_merge_sort(opts);
+    finish_index();
+    std::cerr << "merge passes: " << passes << "\n";
 }
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Sparse index of a sorted file, kept next to it as PATH.idx:
+//
+//   "SIDX" | u32 key size | u64 step | u64 size of the indexed file | entries
+//
+// Every entry is a key followed by the u64 offset of its line: the first line
+// starting at or after each multiple of `step`. A lookup binary searches the
+// entries and reads the file from the last one with a smaller key, so a point
+// query costs about one block.
+
+static const char INDEX_MAGIC[4] = {'S', 'I', 'D', 'X'};
+static const size_t INDEX_HEADER = 24;
+
+inline std::string index_path(const std::string& path) {
+    return path + ".idx";
+}
+
+// The file to index, set by --index.
+struct index_target {
+    std::string path; // empty - none
+    size_t step = 4096;
+    bool fresh = false; // the index matches the file: the last writer of the file built it
+};
+
+inline index_target indexed;
+
+// Collects entries as lines are written at increasing offsets.
+class index_builder {
+    std::string path;
+    size_t keySize;
+    size_t step;
+    size_t next = 0; // offset that gets the next entry
+    std::vector<char> entries;
+
+public:
+    index_builder(const std::string& path, size_t keySize, size_t step)
+        : path(path), keySize(keySize), step(step) {}
+
+    void add(std::string_view key, size_t offset) {
+        if (offset < next)
+            return;
+        size_t at = entries.size();
+        entries.resize(at + keySize + 8, ' ');
+        memcpy(entries.data() + at, key.data(), std::min(key.size(), keySize));
+        uint64_t off = offset;
+        memcpy(entries.data() + at + keySize, &off, 8);
+        next = offset - offset % step + step;
+    }
+
+    // Writes the sidecar; the indexed file ended up `size` bytes long.
+    void write(size_t size) const {
+        FILE* f = fopen(index_path(path).c_str(), "wb");
+        if (!f) {
+            perror("open");
+            exit(1);
+        }
+        char header[INDEX_HEADER];
+        uint32_t k = keySize;
+        uint64_t s = step, n = size;
+        memcpy(header, INDEX_MAGIC, 4);
+        memcpy(header + 4, &k, 4);
+        memcpy(header + 8, &s, 8);
+        memcpy(header + 16, &n, 8);
+        if (fwrite(header, 1, sizeof header, f) != sizeof header ||
+            fwrite(entries.data(), 1, entries.size(), f) != entries.size() || fclose(f) != 0) {
+            perror("write");
+            exit(1);
+        }
+    }
+};
+
+// A builder if `path` is the file to index. Opening it for writing makes the
+// current index stale until the new one is written.
+inline std::unique_ptr<index_builder> index_for(const std::string& path, size_t keySize) {
+    if (indexed.path.empty() || path != indexed.path)
+        return nullptr;
+    indexed.fresh = false;
+    return std::make_unique<index_builder>(path, keySize, indexed.step);
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+// Process-wide counters. Readers and writers add to them once per buffer, so
+// they are cheap enough to stay on whether or not anyone reads them.
+struct io_counters {
+    std::atomic<uint64_t> bytesRead{0};
+    std::atomic<uint64_t> bytesWritten{0};
+    std::atomic<uint64_t> records{0};    // written
+    std::atomic<uint64_t> ioNanos{0};    // blocked in read/write (or waiting on the async thread)
+    std::atomic<uint64_t> parseNanos{0}; // splitting buffers into records
+};
+
+inline io_counters io_stats;
+
+inline uint64_t now_nanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()
+    )
+        .count();
+}
+
+// Adds the lifetime of the scope to a counter.
+class scoped_timer {
+    std::atomic<uint64_t>& to;
+    uint64_t start = now_nanos();
+
+public:
+    explicit scoped_timer(std::atomic<uint64_t>& to) : to(to) {}
+
+    ~scoped_timer() {
+        to.fetch_add(now_nanos() - start, std::memory_order_relaxed);
+    }
+};
+
+// One JSON line per pass over the data, from the counters above:
+//
+//   {"pass": 2, "phase": "merge", "runs_in": 40, "runs_out": 1, "records": ...,
+//    "bytes_read": ..., "bytes_written": ..., "io_s": ..., "parse_s": ...,
+//    "compare_s": ..., "wall_s": ..., "records_per_s": ...}
+//
+// Times are summed over threads. parse_s covers batch parsing only, records
+// read one at a time are counted with the rest of the wall time in compare_s:
+// sorting, merging and moving records. Writers publish their counts when they
+// flush, so a pass has to close its writers before end().
+class metrics_log {
+    FILE* out = nullptr;
+    size_t pass = 0;
+    uint64_t start = 0;
+    uint64_t bytesRead = 0, bytesWritten = 0, records = 0, ioNanos = 0, parseNanos = 0;
+
+public:
+    // "-" logs to stderr.
+    void open(const std::string& path) {
+        out = path == "-" ? stderr : fopen(path.c_str(), "w");
+        if (!out) {
+            perror("open");
+            exit(1);
+        }
+    }
+
+    ~metrics_log() {
+        if (out && out != stderr)
+            fclose(out);
+    }
+
+    void begin() {
+        start = now_nanos();
+        bytesRead = io_stats.bytesRead;
+        bytesWritten = io_stats.bytesWritten;
+        records = io_stats.records;
+        ioNanos = io_stats.ioNanos;
+        parseNanos = io_stats.parseNanos;
+    }
+
+    void end(const char* phase, size_t runsIn, size_t runsOut) {
+        if (!out)
+            return;
+
+        double wall = (now_nanos() - start) / 1e9;
+        double io = (io_stats.ioNanos - ioNanos) / 1e9;
+        double parse = (io_stats.parseNanos - parseNanos) / 1e9;
+        uint64_t n = io_stats.records - records;
+        fprintf(
+            out,
+            "{\"pass\": %zu, \"phase\": \"%s\", \"runs_in\": %zu, \"runs_out\": %zu, "
+            "\"records\": %llu, \"bytes_read\": %llu, \"bytes_written\": %llu, "
+            "\"io_s\": %.6f, \"parse_s\": %.6f, \"compare_s\": %.6f, \"wall_s\": %.6f, "
+            "\"records_per_s\": %.0f}\n",
+            pass++, phase, runsIn, runsOut, (unsigned long long)n,
+            (unsigned long long)(io_stats.bytesRead - bytesRead),
+            (unsigned long long)(io_stats.bytesWritten - bytesWritten), io, parse,
+            wall > io + parse ? wall - io - parse : 0.0, wall, wall > 0 ? n / wall : 0.0
+        );
+        fflush(out);
+    }
+};
+
+inline metrics_log metrics;
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "shared.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Writes the `k` smallest records of `input` within `range` to `output`, in
+// order, in a single pass. A max-heap holds the k best so far; a record only
+// gets in by beating the largest of them, so memory is O(k) records whatever
+// the input size. Among equal keys the first ones read win, as in a full
+// stable sort. The input is fully read before the output is opened, so the
+// two may be the same file.
+template <typename Reader = fast_reader, typename Writer = fast_writer>
+size_t top_k(const std::string& input, const std::string& output, size_t k, const key_range& range) {
+    struct node {
+        record r;
+        uint64_t seq; // input position, breaks ties
+    };
+    auto before = [](const node& a, const node& b) {
+        if (a.r < b.r)
+            return true;
+        return !(b.r < a.r) && a.seq < b.seq;
+    };
+
+    std::vector<node> heap; // grows with the input: k may be far larger than it
+    {
+        Reader in(input);
+        record_batch batch;
+        uint64_t seq = 0;
+        while (in.next_batch(batch)) {
+            batch.filter(0, range);
+            for (size_t i = 0; i < batch.size(); ++i, ++seq) {
+                record_view r = batch[i];
+                if (heap.size() == k) {
+                    // later records lose ties, so only a strictly smaller key gets in
+                    const record& worst = heap.front().r;
+                    if (!key_less(r.packed, r.key, worst.packed, worst.key))
+                        continue;
+                    std::pop_heap(heap.begin(), heap.end(), before);
+                } else {
+                    heap.emplace_back();
+                }
+
+                node& n = heap.back();
+                n.r.key.assign(r.key);
+                n.r.data.assign(r.data);
+                n.r.packed = r.packed;
+                n.seq = seq;
+                std::push_heap(heap.begin(), heap.end(), before);
+            }
+        }
+    }
+
+    std::sort_heap(heap.begin(), heap.end(), before);
+    Writer w(output);
+    for (const auto& n : heap) {
+        w.write_record(n.r);
+    }
+    return heap.size();
+}